@@ -34,20 +34,113 @@ typedef unsigned long long int uint64_t;
 //  Types specific to the FUSE driver
 //
 
-typedef struct _IRP_LIST {
-    PIRP Irp;
-    struct _IRP_LIST* Next;
-} IRP_LIST, *PIRP_LIST;
+//
+//  The outstanding request table, the IRP queue and the module map are
+//  parameterized on how they get memory and how they lock; the driver's
+//  allocators, lock policy and key traits live in fuseutil.h
+//
+
+struct FusePoolAllocator;
+struct FuseNonPagedPoolAllocator;
+struct FuseSync;
+struct FuseModuleNameTraits;
+struct FuseFileObjectTraits;
+
+#include "reqtable.h"
+#include "pairqueue.h"
+#include "hashtable.h"
+#include "negcache.h"
+#include "fusent_ring.h"
+
+typedef RequestTable<PIRP, FusePoolAllocator> FUSE_REQUEST_TABLE;
+typedef PairingQueue<PIRP, FuseSync, FuseNonPagedPoolAllocator> FUSE_IRP_QUEUE;
+typedef NegativeNameCache<WCHAR, FuseSync, FusePoolAllocator> FUSE_NEGATIVE_CACHE;
+
+//
+//  Shared-memory rings set up at mount time (see FUSENT_RING_SETUP). The
+//  driver produces into the submission ring and consumes the completion
+//  ring; each side of each ring is serialized by its own lock
+//
+
+typedef struct _FUSE_RING {
+    PMDL Mdl;
+    PKEVENT SqEvent;
+
+    //
+    //  SqLock protects Sq, Backlog, the userspace IRPs waiting for room in
+    //  the submission ring (linked through Tail.Overlay.ListEntry), and
+    //  SqWaiting, set while the driver has asked to be told about room
+    //
+
+    FAST_MUTEX SqLock;
+    FUSENT_RING_VIEW Sq;
+    LIST_ENTRY Backlog;
+    BOOLEAN SqWaiting;
+
+    //
+    //  CqLock protects Cq and Staging, where each response is copied out of
+    //  the shared region before it is looked at, so that the module can't
+    //  change it underneath us
+    //
+
+    FAST_MUTEX CqLock;
+    FUSENT_RING_VIEW Cq;
+    PCHAR Staging;
+} FUSE_RING, *PFUSE_RING;
+
+//
+//  A read or write that went to its module in pieces (see FuseSplitIrp). The
+//  last piece to complete fills in the original IRP's IoStatus from it and
+//  frees it
+//
+
+typedef struct _FUSE_SPLIT {
+    PIRP MasterIrp;
+    LONGLONG ByteOffset;
+
+    //
+    //  The number of pieces yet to complete
+    //
+
+    volatile LONG Pieces;
+
+    //
+    //  The number of bytes from the start of the request that the pieces have
+    //  read or written without a gap, i.e. up to where the first piece that
+    //  came up short stopped (a ULONG, kept as a LONG for the interlocked
+    //  operations)
+    //
+
+    volatile LONG Done;
+
+    //
+    //  The first failure of any piece other than running into the end of the
+    //  file, and whether any piece did that
+    //
+
+    volatile LONG Status;
+    volatile LONG EndOfFile;
+} FUSE_SPLIT, *PFUSE_SPLIT;
 
 typedef struct _MODULE_STRUCT {
     //
-    //  Maintain a list of available IRPs from the module
-    //  that can be used to satisfy requests from userspace
-    //  and a list of IRPs from userspace waiting to be
-    //  fulfilled by the module
+    //  Pair up IRPs from the module that can be used to
+    //  satisfy requests from userspace with IRPs from
+    //  userspace waiting to be fulfilled by the module.
+    //  The queue is sharded per processor and does its
+    //  own locking
+    //
+
+    FUSE_IRP_QUEUE IrpQueue;
+
+    //
+    //  Userspace IRPs that have been handed to the module and
+    //  are waiting for its response, indexed by the request ID
+    //  passed along in FUSENT_REQ and echoed back in FUSENT_RESP.
+    //  ModuleLock protects the table
     //
-    PIRP_LIST ModuleIrpList, UserspaceIrpList, OutstandingIrpList;
-    PIRP_LIST ModuleIrpListEnd, UserspaceIrpListEnd, OutstandingIrpListEnd;
+
+    FUSE_REQUEST_TABLE OutstandingIrps;
     FAST_MUTEX ModuleLock;
 
     //
@@ -65,6 +158,78 @@ typedef struct _MODULE_STRUCT {
     //  file object pointer to the one in the incoming IRP
     //
     PFILE_OBJECT ModuleFileObject;
+
+    //
+    //  The module map holds a reference for as long as the
+    //  module is mounted, and every file opened on the module
+    //  holds one (the file object's FsContext2 points here)
+    //  until it is closed. The struct is freed along with the
+    //  last reference
+    //
+
+    volatile LONG RefCount;
+
+    //
+    //  Held while an IRP is being queued, so that a dismount
+    //  can wait for queueing to finish before it fails every
+    //  IRP still queued. RundownDone makes sure that only
+    //  happens once
+    //
+
+    EX_RUNDOWN_REF Rundown;
+    volatile LONG RundownDone;
+
+    //
+    //  NULL unless the module mounted with shared-memory rings, in which
+    //  case userspace IRPs go through them instead of IrpQueue. Set before
+    //  the module is in the map and torn down by the rundown
+    //
+
+    PFUSE_RING Ring;
+
+    //
+    //  The FUSENT_PROTO_ version requests go to the module in, as agreed
+    //  at mount time
+    //
+
+    ULONG ProtocolVersion;
+
+    //
+    //  The module's process, referenced at mount time, which mapped
+    //  writes are mapped into (see FuseMapIntoModule)
+    //
+
+    PEPROCESS ModuleProcess;
+
+    //
+    //  The largest read and write the module takes in one request, as
+    //  agreed at mount time; larger ones are split up (see FuseSplitIrp).
+    //  Zero for no limit
+    //
+
+    ULONG MaxRead;
+    ULONG MaxWrite;
+
+    //
+    //  Names on the module it said don't exist, whose opens are failed
+    //  here until the module's negative timeout runs out (see negcache.h).
+    //  Does its own locking
+    //
+
+    FUSE_NEGATIVE_CACHE MissingNames;
 } MODULE_STRUCT, *PMODULE_STRUCT;
 
+//
+//  Mounted modules, keyed by module name
+//
+
+typedef HashTable<WCHAR*, PMODULE_STRUCT, FuseModuleNameTraits, FuseSync, FusePoolAllocator> FUSE_MODULE_MAP;
+
+//
+//  Information kept for open files, keyed by file object (see
+//  FuseStashFileInformation)
+//
+
+typedef HashTable<PFILE_OBJECT, struct _FUSE_FILE_CONTEXT*, FuseFileObjectTraits, FuseSync, FusePoolAllocator> FUSE_FILE_CONTEXT_MAP;
+
 #endif // __BASICTYPES
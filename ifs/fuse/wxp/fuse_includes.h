@@ -35,8 +35,4 @@
 #include "fuseprocs.h"
 #include "fuseutil.h"
 
-/* 3rd-party hashmap library; TODO nuke, replace with kernel ADTs... */
-
-#include "hashmap.h"
-
 #endif
@@ -104,20 +104,21 @@ DriverEntry(
     FuseFastIoDispatch.ReleaseForCcFlush =          FuseReleaseForCcFlush;
 
     //
-    //  Register the file system with the I/O system
+    //  Set up the FUSE module map before anyone can mount. The module
+    //  map associates module names with module structs, which store
+    //  IRPs representing requests for work from the module and
+    //  from userspace applications as well as a mutex
     //
 
-    IoRegisterFileSystem(FuseFileSystemDeviceObject);
-    ObReferenceObject (FuseFileSystemDeviceObject);
+    ModuleMap.Init();
+    FileContextMap.Init();
 
     //
-    //  Set up FUSE module map and userspace map. The module map
-    //  associates module names with module structs, which store
-    //  IRPs representing requests for work from the module and
-    //  from userspace applications as well as a mutex
+    //  Register the file system with the I/O system
     //
 
-    mk_hmap(&ModuleMap, str_hash_fn, str_eq_fn, module_struct_delete);
+    IoRegisterFileSystem(FuseFileSystemDeviceObject);
+    ObReferenceObject (FuseFileSystemDeviceObject);
 
     //
     //  And return to our caller
@@ -150,5 +151,11 @@ Return Value:
 
 {
     ObDereferenceObject(FuseFileSystemDeviceObject);
-    free_hmap(&ModuleMap);
+    ModuleMap.Destroy(FuseDereferenceModule);
+
+    //
+    //  Every file has been closed by now, and their contexts freed with them
+    //
+
+    FileContextMap.Destroy(NULL);
 }
@@ -14,9 +14,26 @@ FuseAddIrpToModuleList (
     );
 
 BOOLEAN
-FuseCheckForWork (
+FuseEnqueueIrp (
     IN PMODULE_STRUCT ModuleStruct,
-    IN PIRP InFlightModuleIrp
+    IN PIRP Irp,
+    IN ULONG Kind,
+    IN ULONG Processor
+    );
+
+VOID
+FuseQueueIrp (
+    IN PMODULE_STRUCT ModuleStruct,
+    IN PIRP Irp,
+    IN ULONG Kind
+    );
+
+BOOLEAN
+FuseHandOffWork (
+    IN PMODULE_STRUCT ModuleStruct,
+    IN PIRP UserspaceIrp,
+    IN PIRP ModuleIrp,
+    IN ULONG Processor
     );
 
 NTSTATUS
@@ -31,13 +48,132 @@ FuseCheckUnmountModule (
     IN PIO_STACK_LOCATION IrpSp
     );
 
+static WCHAR*
+FuseCreateFileName (
+    IN PIRP UserspaceIrp,
+    OUT PULONG FileNameLength
+    );
+
+static BOOLEAN
+FuseCreateMayCreate (
+    IN PIO_STACK_LOCATION IrpSp
+    );
+
+//
+//  Mounted modules by name. The map does its own locking and
+//  grows as modules are mounted (see hashtable.h)
+//
+FUSE_MODULE_MAP ModuleMap;
+
+//
+//  The smallest read or write whose buffer is mapped into a module that can
+//  take it that way rather than copied (see FuseMapsBuffer). Below this the
+//  copy is cheaper than setting up and tearing down the mapping
+//
+
+#define FUSE_MAPPED_IO_MIN (64 * 1024)
+
+VOID
+FuseCompleteCancelledIrp (
+    IN PIRP Irp
+    )
+{
+    FuseUnmapFromModule(Irp);
+
+    Irp->IoStatus.Status = STATUS_CANCELLED;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+PMODULE_STRUCT
+FuseLookupModule (
+    IN WCHAR* ModuleName
+    )
+//
+//  Finds the mounted module with the given name. The module returned is
+//  referenced, and the caller must drop the reference with
+//  FuseDereferenceModule when done with it
+//
+{
+    PMODULE_STRUCT ModuleStruct;
+
+    if(!ModuleMap.Lookup(ModuleName, &ModuleStruct, FuseReferenceModule)) {
+        return NULL;
+    }
+
+    return ModuleStruct;
+}
+
+VOID
+FuseReferenceModule (
+    IN PMODULE_STRUCT ModuleStruct
+    )
+{
+    InterlockedIncrement(&ModuleStruct->RefCount);
+}
+
+VOID
+FuseDereferenceModule (
+    IN PMODULE_STRUCT ModuleStruct
+    )
+//
+//  Drops a reference to the module, freeing it along with the last one
+//
+{
+    if(InterlockedDecrement(&ModuleStruct->RefCount) == 0) {
+        FuseRundownModule(ModuleStruct);
+
+        if(ModuleStruct->ModuleProcess) {
+            ObDereferenceObject(ModuleStruct->ModuleProcess);
+        }
+
+        ModuleStruct->MissingNames.Destroy();
+
+        ExFreePool(ModuleStruct->ModuleName);
+        ExFreePool(ModuleStruct);
+    }
+}
+
+VOID
+FuseRundownModule (
+    IN PMODULE_STRUCT ModuleStruct
+    )
 //
-//  This hash map implementation uses linear probing, which
-//  is not very fast for densely populated maps, but we set
-//  the initial size of the map to be large enough so that
-//  the type of probing is somewhat irrelevant
+//  Stops any more IRPs from being queued for the module, waits for the ones
+//  being queued right now, and then cancels every IRP that is still queued
+//  or waiting on a response from the module. Only the first call does
+//  anything
 //
-hashmap ModuleMap;
+{
+    uint64_t CacheHits, CacheMisses;
+
+    if(InterlockedExchange(&ModuleStruct->RundownDone, 1)) {
+        return;
+    }
+
+    ExWaitForRundownProtectionRelease(&ModuleStruct->Rundown);
+
+    ModuleStruct->IrpQueue.CacheStats(&CacheHits, &CacheMisses);
+
+    DbgPrint("Module %S: IRP queue entry cache had %I64u hits and %I64u misses\n",
+        ModuleStruct->ModuleName, CacheHits, CacheMisses);
+
+    ModuleStruct->MissingNames.Stats(&CacheHits, &CacheMisses);
+
+    DbgPrint("Module %S: negative name cache had %I64u hits and %I64u misses\n",
+        ModuleStruct->ModuleName, CacheHits, CacheMisses);
+
+    ModuleStruct->IrpQueue.Destroy(FuseCompleteCancelledIrp);
+
+    {
+        ScopedExLock Lock(&ModuleStruct->ModuleLock);
+
+        ModuleStruct->OutstandingIrps.Drain(FuseCompleteCancelledIrp);
+    }
+
+    if(ModuleStruct->Ring) {
+        FuseTeardownRing(ModuleStruct);
+    }
+}
 
 NTSTATUS
 FuseAddUserspaceIrp (
@@ -52,48 +188,105 @@ FuseAddUserspaceIrp (
     WCHAR* FileName = FileNameString->Buffer + 1;
 #endif
     WCHAR* ModuleName;
-    PMODULE_STRUCT ModuleStruct;
+    PMODULE_STRUCT ModuleStruct = (PMODULE_STRUCT) IrpSp->FileObject->FsContext2;
+    BOOLEAN LookedUp = FALSE;
+    BOOLEAN Missing = FALSE;
+    int32_t MissingStatus;
 
 #ifdef FUSE_DEBUG0
     DbgPrint("Adding userspace IRP to queue for file %S\n", FileName);
 #endif
 
     //
-    //  Check if a module was opened, as opposed to just \Device\Fuse. There
-    //  is nothing to be done if the file is not on a module
+    //  A file opened on a module keeps a referenced pointer to the module in
+    //  FsContext2 (see FuseCopyResponse), so only a CREATE has to look its
+    //  module up by name. Check if a module was opened, as opposed to just
+    //  \Device\Fuse. There is nothing to be done if the file is not on a module
     //
 
-    if (FileNameString->Length > 0) {
+    if(!ModuleStruct && FileNameString->Length > 0) {
         ModuleName = FuseAllocateModuleName(Irp);
 
 #ifdef FUSE_DEBUG0
         DbgPrint("Parsed module name for userspace request is %S\n", ModuleName);
 #endif
 
-        ModuleStruct = (PMODULE_STRUCT) hmap_get(&ModuleMap, ModuleName);
+        ModuleStruct = FuseLookupModule(ModuleName);
+        LookedUp = TRUE;
+
         if(!ModuleStruct) {
             DbgPrint("No entry in map found for module %S. Completing request\n", ModuleName);
+        }
 
-            IoCompleteRequest(Irp, IO_NO_INCREMENT);
-            Status = STATUS_SUCCESS;
-        } else {
+        ExFreePool(ModuleName);
+    }
+
+    if(!ModuleStruct) {
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        Status = STATUS_SUCCESS;
+    } else if(!ExAcquireRundownProtection(&ModuleStruct->Rundown)) {
+
+        //
+        //  The module is being dismounted
+        //
+
+        Irp->IoStatus.Status = STATUS_NO_SUCH_DEVICE;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        Status = STATUS_NO_SUCH_DEVICE;
+    } else {
 #ifdef FUSE_DEBUG0
-            DbgPrint("Found entry in map for module %S. Adding userspace IRP to module queue\n", ModuleName);
+        DbgPrint("Adding userspace IRP to queue for module %S\n", ModuleStruct->ModuleName);
 #endif
 
-            FuseAddIrpToModuleList(Irp, ModuleStruct, FALSE);
+        //
+        //  Nothing is mapped into the module for the IRP yet (see FuseMapIntoModule)
+        //
+
+        Irp->Tail.Overlay.DriverContext[0] = NULL;
+        Irp->Tail.Overlay.DriverContext[1] = NULL;
+
+        //
+        //  An open of a name the module has lately said doesn't exist fails
+        //  right here. Otherwise the IRP carries the name's negative cache
+        //  ticket, in case the module says so now (see FuseCompleteResponse)
+        //
+
+        if(IrpSp->MajorFunction == IRP_MJ_CREATE && !FuseCreateMayCreate(IrpSp)) {
+            ULONG FileNameLength;
+            WCHAR* FileName = FuseCreateFileName(Irp, &FileNameLength);
+            ULONG Length = FileNameLength / sizeof(WCHAR) - 1;
+
+            Missing = ModuleStruct->MissingNames.Lookup(FileName, Length, KeQueryInterruptTime(), &MissingStatus);
+
+            Irp->Tail.Overlay.DriverContext[2] = (PVOID) (ULONG_PTR) ModuleStruct->MissingNames.Ticket(FileName, Length);
+        }
+
+        //
+        //  A module with shared-memory rings gets its work through them rather
+        //  than by pairing up IRPs
+        //
+
+        if(Missing) {
+            Irp->IoStatus.Status = MissingStatus;
+            Irp->IoStatus.Information = 0;
+            IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+            Status = MissingStatus;
+        } else if(ModuleStruct->Ring) {
+            FuseRingSubmit(ModuleStruct, Irp);
 
-            FusePrePostIrp(Irp);
-            IoMarkIrpPending(Irp);
             Status = STATUS_PENDING;
+        } else {
+            FuseAddIrpToModuleList(Irp, ModuleStruct, FALSE);
 
-            FuseCheckForWork(ModuleStruct, NULL);  
+            Status = STATUS_PENDING;
         }
 
-        ExFreePool(ModuleName);
-    } else {
-        IoCompleteRequest(Irp, IO_NO_INCREMENT);
-        Status = STATUS_SUCCESS;
+        ExReleaseRundownProtection(&ModuleStruct->Rundown);
+    }
+
+    if(LookedUp && ModuleStruct) {
+        FuseDereferenceModule(ModuleStruct);
     }
 
     return Status;
@@ -106,9 +299,12 @@ FuseAddIrpToModuleList (
     IN BOOLEAN AddToModuleList
     )
 //
-//  Adds the given IRP to the module IRP list if the AddToModuleList flag is on, and
-//  adds the given IRP to the userspace IRP list otherwise. Validates the user buffer
-//  of module IRPs and returns FALSE if the validation fails, TRUE otherwise
+//  Queues the given IRP as a module IRP waiting for work if the AddToModuleList flag is
+//  on, and as a userspace IRP waiting for a module otherwise, handing off any work that
+//  can now be paired up. Validates the user buffer of module IRPs and returns FALSE if
+//  the validation fails, in which case nothing has been done with the IRP. Otherwise
+//  the IRP has been marked pending (and may already have been completed), so the caller
+//  should return STATUS_PENDING
 //
 {
 #ifdef FUSE_DEBUG0
@@ -124,6 +320,10 @@ FuseAddIrpToModuleList (
         ULONG StackLength = Irp->StackCount * sizeof(IO_STACK_LOCATION);
         ExpectedBufferLength = sizeof(FUSENT_REQ) + StackLength;
 
+        if(ModuleIrpSp->Parameters.FileSystemControl.FsControlCode == IRP_FUSE_MODULE_REQUEST_BATCH) {
+            ExpectedBufferLength += sizeof(FUSENT_REQ_HDR);
+        }
+
         //
         //  Check that the output buffer is large enough to contain the work request
         //
@@ -137,460 +337,878 @@ FuseAddIrpToModuleList (
         }
     }
 
-    {
-        ScopedExLock(&ModuleStruct->ModuleLock);
+    //
+    //  Once the IRP is queued another thread may pair it off and complete it at any
+    //  time, so it has to be marked pending first
+    //
+
+    FusePrePostIrp(Irp);
+    IoMarkIrpPending(Irp);
+
+    FuseQueueIrp(ModuleStruct, Irp, AddToModuleList ? PAIRQUEUE_WORKER : PAIRQUEUE_WORK);
+
+#ifdef FUSE_DEBUG0
+    DbgPrint("Successfully added %s request IRP to queue\n", (AddToModuleList ? "module" : "userspace"));
+#endif
+
+    return TRUE;
+}
+
+BOOLEAN
+FuseEnqueueIrp (
+    IN PMODULE_STRUCT ModuleStruct,
+    IN PIRP Irp,
+    IN ULONG Kind,
+    IN ULONG Processor
+    )
+//
+//  Adds a pending IRP to the given processor's shard of the module's queue, failing
+//  the IRP if there is no memory to queue it. Returns whether the IRP made a pair
+//  that the caller now has to take off the queue and hand off
+//
+{
+    bool Matched;
+
+    if(!ModuleStruct->IrpQueue.Add(Kind, Irp, Processor, &Matched)) {
+        DbgPrint("Out of memory queueing IRP for module %S\n", ModuleStruct->ModuleName);
+
+        Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+        return FALSE;
+    }
+
+    return Matched ? TRUE : FALSE;
+}
+
+VOID
+FuseQueueIrp (
+    IN PMODULE_STRUCT ModuleStruct,
+    IN PIRP Irp,
+    IN ULONG Kind
+    )
+//
+//  Adds a pending userspace (PAIRQUEUE_WORK) or module (PAIRQUEUE_WORKER) IRP to the
+//  current processor's shard of the module's queue. For as long as that, or an IRP
+//  the hand-off puts back, makes a pair, take the pair and hand the work off
+//
+{
+    ULONG Processor = KeGetCurrentProcessorNumber();
+    BOOLEAN Matched = FuseEnqueueIrp(ModuleStruct, Irp, Kind, Processor);
+
+    while(Matched) {
+        PIRP UserspaceIrp, ModuleIrp;
+
+#ifdef FUSE_DEBUG0
+        DbgPrint("Work found for module %S. Pairing userspace request with module request for work\n",
+            ModuleStruct->ModuleName);
+#endif
+
+        ModuleStruct->IrpQueue.TakePair(Processor, &UserspaceIrp, &ModuleIrp);
+
+        Matched = FuseHandOffWork(ModuleStruct, UserspaceIrp, ModuleIrp, Processor);
+    }
+}
+
+static bool
+FuseIrpFromThread (
+    IN PIRP Irp,
+    IN PVOID Thread
+    )
+{
+    return Irp->Tail.Overlay.Thread == (PETHREAD) Thread;
+}
+
+static VOID
+FuseReleaseModuleIrps (
+    IN PMODULE_STRUCT ModuleStruct,
+    IN PETHREAD Thread
+    )
+//
+//  Completes the module IRPs the given thread has waiting for work, with nothing in
+//  them, for IRP_FUSE_MODULE_WAKE. The module's other threads keep theirs. Module IRPs
+//  that a userspace request has already claimed are handed off as usual
+//
+{
+    ULONG Processor = KeGetCurrentProcessorNumber();
+    PIRP UserspaceIrp, ModuleIrp;
+    bool Matched;
+
+    while(ModuleStruct->IrpQueue.TakeUnclaimedMatching(PAIRQUEUE_WORKER, Processor,
+        FuseIrpFromThread, Thread, &ModuleIrp, &Matched)) {
+
+        ModuleIrp->IoStatus.Status = STATUS_SUCCESS;
+        ModuleIrp->IoStatus.Information = 0;
+        IoCompleteRequest(ModuleIrp, IO_NO_INCREMENT);
+    }
+
+    //
+    //  Looking may have held up a pair, which is ours to hand off now
+    //
+
+    while(Matched) {
+        ModuleStruct->IrpQueue.TakePair(Processor, &UserspaceIrp, &ModuleIrp);
+
+        Matched = FuseHandOffWork(ModuleStruct, UserspaceIrp, ModuleIrp, Processor);
+    }
+}
+
+BOOLEAN
+FuseHandOffWork (
+    IN PMODULE_STRUCT ModuleStruct,
+    IN PIRP UserspaceIrp,
+    IN PIRP ModuleIrp,
+    IN ULONG Processor
+    )
+//
+//  Copy the given userspace request into the given module IRP's buffer and complete the
+//  module IRP to signal that the module should process it. A module IRP that asked for
+//  a batch also takes as much of the other queued work as fits. If the pair can't go
+//  through, whichever IRP is still good is put back on the queue
+//
+//  Returns whether putting an IRP back made another pair for the caller to hand off
+//
+{
+    PIO_STACK_LOCATION ModuleIrpSp;
+    PCHAR Buffer;
+    ULONG BufferLength;
+    ULONG Used;
+    BOOLEAN Batched;
+    BOOLEAN Matched = FALSE;
+    NTSTATUS Status;
+
+    //
+    //  If an IRP has been cancelled, complete it as such and put the other one back
+    //
+
+    if(UserspaceIrp->Cancel) {
+        UserspaceIrp->IoStatus.Status = STATUS_CANCELLED;
+        IoCompleteRequest(UserspaceIrp, IO_NO_INCREMENT);
+
+        return FuseEnqueueIrp(ModuleStruct, ModuleIrp, PAIRQUEUE_WORKER, Processor);
+    } else if(ModuleIrp->Cancel) {
+        ModuleIrp->IoStatus.Status = STATUS_CANCELLED;
+        IoCompleteRequest(ModuleIrp, IO_NO_INCREMENT);
+
+        return FuseEnqueueIrp(ModuleStruct, UserspaceIrp, PAIRQUEUE_WORK, Processor);
+    }
+
+    //
+    //  UserspaceIrpSp was NULL for me once...not sure what's up with that
+    //
+
+    if(!IoGetCurrentIrpStackLocation(UserspaceIrp)) {
+        return FuseEnqueueIrp(ModuleStruct, ModuleIrp, PAIRQUEUE_WORKER, Processor);
+    }
+
+    ModuleIrpSp = IoGetCurrentIrpStackLocation(ModuleIrp);
+    Buffer = (PCHAR) ModuleIrp->AssociatedIrp.SystemBuffer;
+    BufferLength = ModuleIrpSp->Parameters.FileSystemControl.OutputBufferLength;
+    Batched = (ModuleIrpSp->Parameters.FileSystemControl.FsControlCode == IRP_FUSE_MODULE_REQUEST_BATCH);
+
+    Status = FusePackRequest(ModuleStruct, UserspaceIrp, Buffer, BufferLength, Batched, &Used);
+
+    if(Status == STATUS_BUFFER_OVERFLOW) {
+
         //
-        //  Add to the list specified by Module--TRUE -> module list, FALSE -> userspace list
+        //  The buffer was too small; bail. The module IRP is used up, but the
+        //  userspace request goes back on the queue for the next one
         //
 
-        PIRP_LIST LastEntry = AddToModuleList ? ModuleStruct->ModuleIrpListEnd : ModuleStruct->UserspaceIrpListEnd;
-        if(!LastEntry) {
+        IoCompleteRequest(ModuleIrp, IO_NO_INCREMENT);
 
-            //
-            //  If the first entry in the list is NULL, replace it with a new entry
-            //
+        return FuseEnqueueIrp(ModuleStruct, UserspaceIrp, PAIRQUEUE_WORK, Processor);
+    } else if(!NT_SUCCESS(Status)) {
 
-            if(AddToModuleList) {
-                ModuleStruct->ModuleIrpList = (PIRP_LIST) ExAllocatePoolWithTag(PagedPool, sizeof(IRP_LIST), M_FUSE);
-                LastEntry = ModuleStruct->ModuleIrpList;
-            } else {
-                ModuleStruct->UserspaceIrpList = (PIRP_LIST) ExAllocatePoolWithTag(PagedPool, sizeof(IRP_LIST), M_FUSE);
-                LastEntry = ModuleStruct->UserspaceIrpList;
+        //
+        //  Out of memory; fail the userspace request and put the module IRP
+        //  back for the next one
+        //
+
+        UserspaceIrp->IoStatus.Status = Status;
+        IoCompleteRequest(UserspaceIrp, IO_NO_INCREMENT);
+
+        return FuseEnqueueIrp(ModuleStruct, ModuleIrp, PAIRQUEUE_WORKER, Processor);
+    }
+
+    //
+    //  Fill the rest of a batch with queued work that no other module IRP has
+    //  claimed, so that a busy module gets many requests per round trip. Work
+    //  that doesn't fit goes back on the queue (which may pair it with a module
+    //  IRP that has just arrived)
+    //
+
+    if(Batched) {
+        PIRP NextIrp;
+
+        while(Used < BufferLength && ModuleStruct->IrpQueue.TakeUnclaimed(PAIRQUEUE_WORK, Processor, &NextIrp)) {
+            ULONG NextUsed;
+
+            if(NextIrp->Cancel) {
+                NextIrp->IoStatus.Status = STATUS_CANCELLED;
+                IoCompleteRequest(NextIrp, IO_NO_INCREMENT);
+
+                continue;
             }
-        } else {
 
-            //
-            //  Insert the new entry at the end of the list
-            //
+            Status = FusePackRequest(ModuleStruct, NextIrp, Buffer + Used, BufferLength - Used, TRUE, &NextUsed);
 
-            LastEntry->Next = (PIRP_LIST) ExAllocatePoolWithTag(PagedPool, sizeof(IRP_LIST), M_FUSE);
-            LastEntry = LastEntry->Next;
+            if(Status == STATUS_BUFFER_OVERFLOW) {
+                Matched = FuseEnqueueIrp(ModuleStruct, NextIrp, PAIRQUEUE_WORK, Processor);
+                break;
+            } else if(!NT_SUCCESS(Status)) {
+                NextIrp->IoStatus.Status = Status;
+                IoCompleteRequest(NextIrp, IO_NO_INCREMENT);
+            } else {
+                Used += NextUsed;
+            }
         }
+    }
 
-        //
-        //  Set the fields of the new entry in the IRP list
-        //
+    ModuleIrp->IoStatus.Information = Used;
+
+    //
+    //  Complete the module's IRP to signal that the module should process it
+    //
 
-        LastEntry->Irp = Irp;
-        LastEntry->Next = NULL;
+    IoCompleteRequest(ModuleIrp, IO_NO_INCREMENT);
 
-        if(AddToModuleList) {
-            ModuleStruct->ModuleIrpListEnd = LastEntry;
-        } else {
-            ModuleStruct->UserspaceIrpListEnd = LastEntry;
-        }
+    return Matched;
+}
+
+static WCHAR*
+FuseCreateFileName (
+    IN PIRP UserspaceIrp,
+    OUT PULONG FileNameLength
+    )
+//
+//  Returns the file name a create is sent to the module with, i.e. the one it was
+//  opened with less the module name, and sets *FileNameLength to its size in bytes
+//  (counting the terminating nul)
+//
+{
+    WCHAR* FileName = IoGetCurrentIrpStackLocation(UserspaceIrp)->FileObject->FileName.Buffer;
+
+    FileName ++;
+    while(FileName[0] != L'\\' && FileName[0] != L'\0') {
+        FileName ++;
     }
 
-#ifdef FUSE_DEBUG0
-    DbgPrint("Successfully added %s request IRP to queue\n", (AddToModuleList ? "module" : "userspace"));
-#endif
+    *FileNameLength = (wcslen(FileName) + 1) * sizeof(WCHAR);
 
-    return TRUE;
+    return FileName;
 }
 
-BOOLEAN
-FuseCheckForWork (
+static BOOLEAN
+FuseCreateMayCreate (
+    IN PIO_STACK_LOCATION IrpSp
+    )
+//
+//  Returns whether the given create may create its file, as opposed to only
+//  opening (or overwriting) one that is already there
+//
+{
+    ULONG Disposition = (IrpSp->Parameters.Create.Options >> 24) & 0xff;
+
+    return Disposition != FILE_OPEN && Disposition != FILE_OVERWRITE;
+}
+
+static PVOID
+FuseCompactRequest (
+    IN PIRP UserspaceIrp,
+    OUT FUSENT_COMPACT_REQ* Req
+    )
+//
+//  Fills in everything but the request ID of the compact form of the given userspace
+//  request (see fusent_compact.h)
+//
+//  Returns the payload that goes with it, if any
+//
+{
+    PIO_STACK_LOCATION UserspaceIrpSp = IoGetCurrentIrpStackLocation(UserspaceIrp);
+    PVOID Data = NULL;
+    ULONG FileNameLength;
+
+    RtlZeroMemory(Req, sizeof(FUSENT_COMPACT_REQ));
+
+    Req->irp = (uint64_t) (ULONG_PTR) UserspaceIrp;
+    Req->file = (uint64_t) (ULONG_PTR) UserspaceIrpSp->FileObject;
+    Req->major = UserspaceIrpSp->MajorFunction;
+    Req->minor = UserspaceIrpSp->MinorFunction;
+    Req->flags = UserspaceIrpSp->Flags;
+
+    if(FlagOn(UserspaceIrp->Flags, IRP_SYNCHRONOUS_API)) {
+        Req->flags |= FUSENT_COMPACT_SYNCHRONOUS;
+    }
+
+    //
+    //  The only associated IRPs we send are the pieces of a split request (see
+    //  FuseSplitIrp)
+    //
+
+    if(FlagOn(UserspaceIrp->Flags, IRP_ASSOCIATED_IRP)) {
+        Req->flags |= FUSENT_COMPACT_PIECE;
+    }
+
+    switch(UserspaceIrpSp->MajorFunction) {
+    case IRP_MJ_CREATE:
+        Req->options = UserspaceIrpSp->Parameters.Create.Options;
+        Data = FuseCreateFileName(UserspaceIrp, &FileNameLength);
+        Req->datalen = FileNameLength;
+        break;
+
+    case IRP_MJ_READ:
+        Req->offset = UserspaceIrpSp->Parameters.Read.ByteOffset.QuadPart;
+        Req->length = UserspaceIrpSp->Parameters.Read.Length;
+        break;
+
+    case IRP_MJ_WRITE:
+        Req->offset = UserspaceIrpSp->Parameters.Write.ByteOffset.QuadPart;
+        Req->length = UserspaceIrpSp->Parameters.Write.Length;
+        Data = FuseMapUserBuffer(UserspaceIrp);
+        Req->datalen = UserspaceIrpSp->Parameters.Write.Length;
+        break;
+
+    case IRP_MJ_DIRECTORY_CONTROL:
+        Req->length = UserspaceIrpSp->Parameters.QueryDirectory.Length;
+        Req->options = UserspaceIrpSp->Parameters.QueryDirectory.FileInformationClass;
+        break;
+
+    case IRP_MJ_QUERY_INFORMATION:
+        Req->length = UserspaceIrpSp->Parameters.QueryFile.Length;
+        Req->options = UserspaceIrpSp->Parameters.QueryFile.FileInformationClass;
+        break;
+    }
+
+    return Data;
+}
+
+static BOOLEAN
+FuseSendsCompact (
     IN PMODULE_STRUCT ModuleStruct,
-    IN PIRP InFlightModuleIrp
+    IN BOOLEAN Batched
     )
 //
-//  Check the given module's userspace and module queues to see if there is work
-//  that can be paired off between the two
+//  Returns whether requests go to the module in the compact format. Only records in
+//  a batch (or a ring) have a header to say which format they are in, so a lone
+//  request is always a FUSENT_REQ
+//
+{
+    return Batched && ModuleStruct->ProtocolVersion >= FUSENT_PROTO_COMPACT;
+}
+
+static BOOLEAN
+FuseMapsBuffer (
+    IN PMODULE_STRUCT ModuleStruct,
+    IN PIRP UserspaceIrp,
+    IN BOOLEAN Batched
+    )
 //
-//  If the given InFlightModuleIrp is non-NULL, this function will return whether
-//  work for the module was found for that IRP
+//  Returns whether the buffer of the given userspace request is mapped into the module
+//  rather than copied, i.e. whether it is a large write (or, for a module that asked for
+//  FUSENT_PROTO_MAPPED_READ, a large read) with its buffer locked down going to a module
+//  that takes FUSENT_COMPACT_MAPPED requests
 //
 {
-    BOOLEAN FoundWork = FALSE;
+    PIO_STACK_LOCATION UserspaceIrpSp = IoGetCurrentIrpStackLocation(UserspaceIrp);
+
+    if(!FuseSendsCompact(ModuleStruct, Batched) || !ModuleStruct->ModuleProcess || !UserspaceIrp->MdlAddress) {
+        return FALSE;
+    }
+
+    if(UserspaceIrpSp->MajorFunction == IRP_MJ_WRITE) {
+        return ModuleStruct->ProtocolVersion >= FUSENT_PROTO_MAPPED &&
+            UserspaceIrpSp->Parameters.Write.Length >= FUSE_MAPPED_IO_MIN;
+    }
+
+    if(UserspaceIrpSp->MajorFunction == IRP_MJ_READ) {
+        return ModuleStruct->ProtocolVersion >= FUSENT_PROTO_MAPPED_READ &&
+            UserspaceIrpSp->Parameters.Read.Length >= FUSE_MAPPED_IO_MIN;
+    }
+
+    return FALSE;
+}
+
+ULONG
+FuseRequestLength (
+    IN PMODULE_STRUCT ModuleStruct,
+    IN PIRP UserspaceIrp,
+    IN BOOLEAN Batched
+    )
+//
+//  Returns the number of bytes FusePackRequest writes the given userspace request
+//  out as, i.e. the FUSENT_REQ or FUSENT_COMPACT_REQ and what follows it, plus the
+//  header and padding in a batch
+//
+{
+    PIO_STACK_LOCATION UserspaceIrpSp = IoGetCurrentIrpStackLocation(UserspaceIrp);
+    ULONG StackLength = UserspaceIrp->StackCount * sizeof(IO_STACK_LOCATION);
+    ULONG ReqSize;
+
+    if(FuseMapsBuffer(ModuleStruct, UserspaceIrp, Batched)) {
+
+        ReqSize = fusent_compact_len(sizeof(FUSENT_COMPACT_MAPPING));
+    } else if(FuseSendsCompact(ModuleStruct, Batched)) {
+        FUSENT_COMPACT_REQ Req;
+
+        FuseCompactRequest(UserspaceIrp, &Req);
+
+        ReqSize = fusent_compact_len(Req.datalen);
+    } else if(FlagOn(UserspaceIrp->Flags, IRP_CREATE_OPERATION)) {
+        ULONG FileNameLength;
+
+        FuseCreateFileName(UserspaceIrp, &FileNameLength);
+
+        ReqSize = sizeof(FUSENT_REQ) + StackLength + sizeof(uint32_t) + FileNameLength;
+    } else if(FlagOn(UserspaceIrp->Flags, IRP_WRITE_OPERATION)) {
+
+        ReqSize = sizeof(FUSENT_REQ) + StackLength + sizeof(uint32_t) + sizeof(LARGE_INTEGER) + UserspaceIrpSp->Parameters.Write.Length;
+    } else {
+
+        ReqSize = sizeof(FUSENT_REQ) + StackLength;
+    }
 
     //
-    //  Check if there is both a userspace request and a module
-    //  IRP to which to hand it off
+    //  Records in a batch are padded so that the next one is aligned
     //
 
-    if(ModuleStruct->ModuleIrpList && ModuleStruct->UserspaceIrpList) {
+    if(Batched) {
+        return (sizeof(FUSENT_REQ_HDR) + ReqSize + FUSENT_BATCH_ALIGN - 1) & ~(FUSENT_BATCH_ALIGN - 1);
+    }
+
+    return ReqSize;
+}
+
+NTSTATUS
+FusePackRequest (
+    IN PMODULE_STRUCT ModuleStruct,
+    IN PIRP UserspaceIrp,
+    OUT PCHAR Buffer,
+    IN ULONG BufferLength,
+    IN BOOLEAN Batched,
+    OUT PULONG Used
+    )
+//
+//  Writes the given userspace request into Buffer as a FUSENT_REQ, or as a
+//  FUSENT_COMPACT_REQ if the module asked for those (preceded by a FUSENT_REQ_HDR
+//  in a batch), and sets *Used to the number of bytes it took up. The
+//  userspace IRP gets a slot in the table of outstanding IRPs (i.e. the IRPs for which
+//  the module has yet to send a reply); the module names it by this ID in its response
+//
+//  The buffer of a large read or write may instead be mapped into the module (see
+//  FuseMapsBuffer); it stays mapped until the IRP leaves the table
+//
+//  Returns STATUS_BUFFER_OVERFLOW if the request does not fit, and
+//  STATUS_INSUFFICIENT_RESOURCES if the table has no room for it or the buffer could not
+//  be mapped. Either way nothing has been done with the IRP
+//
+{
+    PIO_STACK_LOCATION UserspaceIrpSp = IoGetCurrentIrpStackLocation(UserspaceIrp);
+    FUSENT_REQ* FuseNtReq;
+    ULONG HeaderSize = Batched ? sizeof(FUSENT_REQ_HDR) : 0;
+    ULONG RecordSize = FuseRequestLength(ModuleStruct, UserspaceIrp, Batched);
+    BOOLEAN Compact = FuseSendsCompact(ModuleStruct, Batched);
+    PVOID MappedAddress = NULL;
+    uint64_t RequestId;
+
+    ULONG StackLength = UserspaceIrp->StackCount * sizeof(IO_STACK_LOCATION);
 
-        {
-            ScopedExLock(&ModuleStruct->ModuleLock);
+    if(RecordSize > BufferLength) {
 
+#if 0
+        __try {
+            DbgPrint("Request larger than provided buffer. Expected size: %d, actual size: %d for file %S\n",
+                        RecordSize, BufferLength, UserspaceIrpSp->FileObject->FileName.Buffer);
+        } __except(EXCEPTION_EXECUTE_HANDLER) {
+            
             //
-            //  Perform the check again now that we have the lock
+            //  I saw a segmentation fault caused by trying to read one of the above fields, so
+            //  this should help protect against that
             //
+        }
+#endif
 
-            while(ModuleStruct->ModuleIrpList && ModuleStruct->UserspaceIrpList) {
-                PIRP_LIST ModuleIrpListEntry = ModuleStruct->ModuleIrpList;
-                PIRP_LIST UserspaceIrpListEntry = ModuleStruct->UserspaceIrpList;
-                PIRP ModuleIrp = ModuleIrpListEntry->Irp;
-                PIRP UserspaceIrp = UserspaceIrpListEntry->Irp;
-                PIO_STACK_LOCATION UserspaceIrpSp;
-                PIO_STACK_LOCATION ModuleIrpSp;
-                FUSENT_REQ* FuseNtReq;
-                WCHAR* FileName = NULL;
-                ULONG FileNameLength = (ULONG)-1;
-                ULONG ReqSize;
+        return STATUS_BUFFER_OVERFLOW;
+    }
 
-                ULONG StackLength = UserspaceIrp->StackCount * sizeof(IO_STACK_LOCATION);
+    if(FuseMapsBuffer(ModuleStruct, UserspaceIrp, Batched)) {
+        MappedAddress = FuseMapIntoModule(ModuleStruct, UserspaceIrp);
 
-#ifdef FUSE_DEBUG0
-                DbgPrint("Work found for module %S. Pairing userspace request with module request for work\n",
-                    ModuleStruct->ModuleName);
-#endif
+        if(!MappedAddress) {
+            DbgPrint("Could not map a buffer of %d bytes with major code %x into module %S\n",
+                UserspaceIrpSp->Parameters.Read.Length, UserspaceIrpSp->MajorFunction, ModuleStruct->ModuleName);
 
-                if(ModuleIrp == InFlightModuleIrp) {
-                    FoundWork = TRUE;
-                }
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
 
-                //
-                //  If an IRP has been cancelled, remove it from the queue
-                //
+    {
+        ScopedExLock Lock(&ModuleStruct->ModuleLock);
 
-                if(UserspaceIrp->Cancel) {
-                    ModuleStruct->UserspaceIrpList = UserspaceIrpListEntry->Next;
+        RequestId = ModuleStruct->OutstandingIrps.Insert(UserspaceIrp);
+    }
 
-                    if(!ModuleStruct->UserspaceIrpList) {
-                        ModuleStruct->UserspaceIrpListEnd = NULL;
-                    }
+    if(!RequestId) {
+        FuseUnmapFromModule(UserspaceIrp);
 
-                    continue;
-                } else if(ModuleIrp->Cancel) {
-                    ModuleStruct->ModuleIrpList = ModuleIrpListEntry->Next;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
-                    if(!ModuleStruct->ModuleIrpList) {
-                        ModuleStruct->ModuleIrpListEnd = NULL;
-                    }
+    if(Batched) {
+        FUSENT_REQ_HDR* Header = (FUSENT_REQ_HDR*) Buffer;
 
-                    continue;
-                }
+        Header->reclen = RecordSize;
+        Header->flags = Compact ? FUSENT_REQ_COMPACT : 0;
+    }
 
-                UserspaceIrpSp = IoGetCurrentIrpStackLocation(UserspaceIrp);
-                ModuleIrpSp = IoGetCurrentIrpStackLocation(ModuleIrp);
+    if(Compact) {
+        FUSENT_COMPACT_REQ Req;
+        FUSENT_COMPACT_MAPPING Mapping;
+        PVOID Data = FuseCompactRequest(UserspaceIrp, &Req);
 
-                //
-                //  UserspaceIrpSp was NULL for me once...not sure what's up with that
-                //
+        Req.reqid = RequestId;
 
-                if(!UserspaceIrpSp) {
-                    ModuleStruct->UserspaceIrpList = UserspaceIrpListEntry->Next;
+        //
+        //  A mapped write carries where its data is rather than the data, and a
+        //  mapped read where to put it
+        //
 
-                    if(!ModuleStruct->UserspaceIrpList) {
-                        ModuleStruct->UserspaceIrpListEnd = NULL;
-                    }
+        if(MappedAddress) {
+            Mapping.addr = (uint64_t) (ULONG_PTR) MappedAddress;
+            Mapping.len = Req.length;
+            Mapping.reserved = 0;
 
-                    continue;
-                }
+            Req.flags |= FUSENT_COMPACT_MAPPED;
+            Req.datalen = sizeof(Mapping);
+            Data = &Mapping;
+        }
 
-                FuseNtReq = (FUSENT_REQ*) ModuleIrp->AssociatedIrp.SystemBuffer;
+        //
+        //  We keep the position of synchronous files (see FuseAdvanceFilePosition),
+        //  so a module that knows as much can take offsets at their word
+        //
 
-                //
-                //  Calculate the size of the buffer needed before attempting to do any copying
-                //
+        if(ModuleStruct->ProtocolVersion >= FUSENT_PROTO_SPLIT &&
+            (Req.major == IRP_MJ_READ || Req.major == IRP_MJ_WRITE) && (int64_t) Req.offset >= 0) {
 
-                if(FlagOn(UserspaceIrp->Flags, IRP_CREATE_OPERATION)) {
+            Req.flags |= FUSENT_COMPACT_ABSOLUTE;
+        }
 
-                    FileName = UserspaceIrpSp->FileObject->FileName.Buffer;
-                
-                    //
-                    //  Strip out the module name from the file name
-                    //
+        fusent_compact_encode(Buffer + HeaderSize, RecordSize - HeaderSize, &Req, Data);
 
-                    FileName ++;
-                    while(FileName[0] != L'\\' && FileName[0] != L'\0') {
-                        FileName ++;
-                    }
+        *Used = RecordSize;
 
-                    FileNameLength = (wcslen(FileName) + 1) * sizeof(WCHAR);
+        return STATUS_SUCCESS;
+    }
 
-                    ReqSize = sizeof(FUSENT_REQ) + StackLength + sizeof(uint32_t) + FileNameLength;
-                } else if(FlagOn(UserspaceIrp->Flags, IRP_WRITE_OPERATION)) {
+    //
+    //  Perform the copy
+    //
 
-                    ReqSize = sizeof(FUSENT_REQ) + StackLength + sizeof(uint32_t) + sizeof(LARGE_INTEGER) + UserspaceIrpSp->Parameters.Write.Length;
-                } else {
+    FuseNtReq = (FUSENT_REQ*) (Buffer + HeaderSize);
 
-                    ReqSize = sizeof(FUSENT_REQ) + StackLength;
-                }
+    FuseNtReq->pirp = UserspaceIrp;
+    FuseNtReq->fop = UserspaceIrpSp->FileObject;
+    FuseNtReq->reqid = RequestId;
+    FuseNtReq->irp = *UserspaceIrp;
 
-                if(ReqSize <= ModuleIrpSp->Parameters.FileSystemControl.OutputBufferLength) {
+    memcpy(FuseNtReq->iostack, UserspaceIrp + 1, StackLength);
 
-                    //
-                    //  The supplied buffer is large enough; perform the copy
-                    //
+    if(UserspaceIrpSp->MajorFunction == IRP_MJ_CREATE) {
+        PULONG FileNameLengthField = (PULONG) (((PCHAR) FuseNtReq->iostack) + StackLength);
+        ULONG FileNameLength;
+        WCHAR* FileName = FuseCreateFileName(UserspaceIrp, &FileNameLength);
 
-                    FuseNtReq->pirp = UserspaceIrp;
-                    FuseNtReq->fop = UserspaceIrpSp->FileObject;
-                    FuseNtReq->irp = *UserspaceIrp;
+        *FileNameLengthField = FileNameLength;
+        memcpy(FileNameLengthField + 1, FileName, FileNameLength);
 
-                    memcpy(FuseNtReq->iostack, UserspaceIrp + 1, StackLength);
-                
-                    if(UserspaceIrpSp->MajorFunction == IRP_MJ_CREATE) {
-                        PULONG FileNameLengthField = (PULONG) (((PCHAR) FuseNtReq->iostack) + StackLength);
+    } else if(UserspaceIrpSp->MajorFunction == IRP_MJ_WRITE) {
+        PULONG BufLenField;
+        PVOID WriteBufferField;
 
-                        ASSERT(FileNameLength != (ULONG)-1 && FileName);
+        //
+        //  The length and data follow the stack locations (see FUSENT_WRITE_REQ)
+        //
 
-                        *FileNameLengthField = FileNameLength;
-                        memcpy(FileNameLengthField + 1, FileName, FileNameLength);
+        BufLenField = (PULONG) (((PCHAR) FuseNtReq->iostack) + StackLength);
+        *BufLenField = UserspaceIrpSp->Parameters.Write.Length;
 
-                    } else if(UserspaceIrpSp->MajorFunction == IRP_MJ_WRITE) {
-                        PULONG BufLenField;
-                        PVOID WriteBufferField;
-                    
-                        BufLenField = (PULONG) (((PCHAR) FuseNtReq) + ReqSize);
-                        *BufLenField = UserspaceIrpSp->Parameters.Write.Length;
+        WriteBufferField = (PVOID) (BufLenField + 1);
+        memcpy(WriteBufferField, FuseMapUserBuffer(UserspaceIrp), UserspaceIrpSp->Parameters.Write.Length);
+    }
 
-                        WriteBufferField = (PVOID) (BufLenField + 1);
-                        memcpy(WriteBufferField, UserspaceIrp->AssociatedIrp.SystemBuffer, UserspaceIrpSp->Parameters.Write.Length);
-                    }
+    *Used = RecordSize;
 
-                    ModuleIrp->IoStatus.Information = ReqSize;
+    return STATUS_SUCCESS;
+}
 
-                    //
-                    //  Remove the head IRP from the userspace IRP queue
-                    //
+NTSTATUS
+FuseCopyResponse (
+    IN PMODULE_STRUCT ModuleStruct,
+    IN PIRP Irp,
+    IN PIO_STACK_LOCATION IrpSp
+    )
+//
+//  Hand the module's response (or, for IRP_FUSE_MODULE_RESPONSE_BATCH, each of its
+//  responses) to the outstanding userspace IRP it answers; see FuseCompleteResponse.
+//  A batch is processed in one pass under a single acquisition of the module lock
+//
+{
+    NTSTATUS Status = STATUS_SUCCESS;
+    PCHAR Buffer = (PCHAR) Irp->AssociatedIrp.SystemBuffer;
+    ULONG BufferLength = IrpSp->Parameters.FileSystemControl.InputBufferLength;
 
-                    ModuleStruct->UserspaceIrpList = UserspaceIrpListEntry->Next;
+    if(IrpSp->Parameters.FileSystemControl.FsControlCode == IRP_FUSE_MODULE_RESPONSE_BATCH) {
+        ULONG Offset = 0;
 
-                    //
-                    //  If we removed the first entry of the queue, update the end
-                    //  pointer to NULL so that it is not pointing to an invalid entry
-                    //
+        ScopedExLock Lock(&ModuleStruct->ModuleLock);
 
-                    if(!ModuleStruct->UserspaceIrpList) {
-                        ModuleStruct->UserspaceIrpListEnd = NULL;
-                    }
+        while(BufferLength - Offset >= sizeof(FUSENT_RESP_HDR) + sizeof(FUSENT_RESP)) {
+            FUSENT_RESP_HDR* Header = (FUSENT_RESP_HDR*) (Buffer + Offset);
+            NTSTATUS ResponseStatus;
 
-                    //
-                    //  Add the userspace IRP to the list of outstanding IRPs (i.e. the IRPs
-                    //  for which the module has yet to send a reply)
-                    //
+            //
+            //  First validate the record
+            //
 
-                    if(ModuleStruct->OutstandingIrpListEnd) {
-                        ModuleStruct->OutstandingIrpListEnd->Next = UserspaceIrpListEntry;
-                        ModuleStruct->OutstandingIrpListEnd = ModuleStruct->OutstandingIrpListEnd->Next;
-                    } else {
-                        ModuleStruct->OutstandingIrpList = UserspaceIrpListEntry;
-                        ModuleStruct->OutstandingIrpListEnd = ModuleStruct->OutstandingIrpList;
-                    }
-                } else {
+            if(Header->reclen < sizeof(FUSENT_RESP_HDR) + sizeof(FUSENT_RESP) ||
+                Header->reclen > BufferLength - Offset ||
+                Header->reclen % FUSENT_BATCH_ALIGN != 0) {
 
-                    //
-                    //  The buffer was too small; bail
-                    //
+                DbgPrint("Response batch from %S has a bad record of size %d at offset %d\n",
+                    ModuleStruct->ModuleName, Header->reclen, Offset);
 
-#if 0
-                    __try {
-                        DbgPrint("Request larger than provided buffer. Expected size: %d, actual size: %d for file %S\n",
-                                    ReqSize, ModuleIrpSp->Parameters.FileSystemControl.OutputBufferLength, UserspaceIrpSp->FileObject->FileName.Buffer);
-                    } __except(EXCEPTION_EXECUTE_HANDLER) {
-                        
-                        //
-                        //  I saw a segmentation fault caused by trying to read one of the above fields, so
-                        //  this should help protect against that
-                        //
-                    }
-#endif
-                }
+                Status = STATUS_INVALID_BUFFER_SIZE;
+                break;
+            }
 
-                //
-                //  Remove the head entry from the module IRP queue
-                //
+            ResponseStatus = FuseCompleteResponse(ModuleStruct, (FUSENT_RESP*) (Header + 1),
+                Header->reclen - sizeof(FUSENT_RESP_HDR));
 
-                ModuleStruct->ModuleIrpList = ModuleIrpListEntry->Next;
+            if(!NT_SUCCESS(ResponseStatus)) {
+                Status = ResponseStatus;
+            }
 
-                //
-                //  If we removed the first entry of the queue, update the end
-                //  pointer to NULL so that it is not pointing to an invalid entry
-                //
+            Offset += Header->reclen;
+        }
 
-                if(!ModuleStruct->ModuleIrpList) {
-                    ModuleStruct->ModuleIrpListEnd = NULL;
-                }
+    } else if(BufferLength >= sizeof(FUSENT_RESP)) {
 
-                //
-                //  Free the module IRP entry from memory
-                //
+        ScopedExLock Lock(&ModuleStruct->ModuleLock);
 
-                ExFreePool(ModuleIrpListEntry);
+        Status = FuseCompleteResponse(ModuleStruct, (FUSENT_RESP*) Buffer, BufferLength);
 
-                //
-                //  Complete the module's IRP to signal that the module should process it
-                //
+    } else {
 
-                IoCompleteRequest(ModuleIrp, IO_NO_INCREMENT);
-            }
-        }
+        DbgPrint("Response from %S has a bad user buffer. Expected size: %d. Actual size: %d\n",
+            ModuleStruct->ModuleName, sizeof(FUSENT_RESP), BufferLength);
+
+        Status = STATUS_INVALID_BUFFER_SIZE;
     }
 
-    return FoundWork;
+    return Status;
 }
 
 NTSTATUS
-FuseCopyResponse (
+FuseCompleteResponse (
     IN PMODULE_STRUCT ModuleStruct,
-    IN PIRP Irp,
-    IN PIO_STACK_LOCATION IrpSp
+    IN FUSENT_RESP* FuseNtResp,
+    IN ULONG ResponseLength
     )
 //
 //  Attempt to find an outstanding userspace IRP whose pointer
 //  matches that given in the module's response. If one is found
-//  (i.e. the module's response is legitimate) then pair up the
-//  response with the userspace IRP and complete both IRPs
+//  (i.e. the module's response is legitimate) then fill in the
+//  userspace IRP from the response and complete it. ResponseLength
+//  covers the FUSENT_RESP and any data following it. The caller
+//  holds the module lock
 //
 {
     NTSTATUS Status = STATUS_SUCCESS;
+    PIRP UserspaceIrp = FuseNtResp->pirp;
+    ULONG DataLength = ResponseLength - sizeof(FUSENT_RESP);
 
     //
-    //  First validate the user buffer
+    //  Do *not* attempt to complete the userspace IRP until we verify that the pointer
+    //  is valid. The request ID in the response names a slot in the table of outstanding
+    //  userspace IRPs; it only resolves if that slot is live, has not been reused since
+    //  (the ID carries the slot's generation) and holds the IRP the module claims
     //
 
-    if(IrpSp->Parameters.FileSystemControl.InputBufferLength >= sizeof(FUSENT_RESP)) {
+    PIRP* OutstandingIrp = ModuleStruct->OutstandingIrps.Lookup(FuseNtResp->reqid);
 
-        FUSENT_RESP* FuseNtResp = (FUSENT_RESP*) Irp->AssociatedIrp.SystemBuffer;
-        PIRP UserspaceIrp = FuseNtResp->pirp;
+    if(OutstandingIrp && *OutstandingIrp == UserspaceIrp) {
+
+        PIO_STACK_LOCATION UserspaceIrpSp;
+        BOOLEAN Mapped = UserspaceIrp->Tail.Overlay.DriverContext[0] != NULL;
 
         //
-        //  Do *not* attempt to complete the userspace IRP until we verify that the pointer
-        //  is valid. A list of outstanding userspace IRPs is maintained for this purpose
+        //  The module has answered, so the IRP is no longer outstanding
         //
 
-        {
-            ScopedExLock(&ModuleStruct->ModuleLock);
+        ModuleStruct->OutstandingIrps.Remove(FuseNtResp->reqid, NULL);
 
-            PIRP_LIST CurrentEntry = ModuleStruct->OutstandingIrpList;
-            PIRP_LIST PreviousEntry = NULL;
-            if(!CurrentEntry) {
+        FuseUnmapFromModule(UserspaceIrp);
 
-                //
-                //  The list is empty so the module's response is invalid
-                //
+        //
+        //  If the userspace IRP has since been cancelled, complete it as such
+        //
 
-                DbgPrint("Module %S sent a response but there are no outstanding userspace IRPs\n", ModuleStruct->ModuleName);
+        if(UserspaceIrp->Cancel) {
+            UserspaceIrp->IoStatus.Status = STATUS_CANCELLED;
+            IoCompleteRequest(UserspaceIrp, IO_NO_INCREMENT);
 
-                Status = STATUS_INVALID_DEVICE_REQUEST;
-            } else {
-                BOOLEAN MatchFound = FALSE;
+            return STATUS_CANCELLED;
+        }
 
-                while(CurrentEntry && !MatchFound) {
-                    if(CurrentEntry->Irp == UserspaceIrp) {
-                        MatchFound = TRUE;
-                    } else {
-                        PreviousEntry = CurrentEntry;
-                        CurrentEntry = CurrentEntry->Next;
-                    }
-                }
+        UserspaceIrpSp = IoGetCurrentIrpStackLocation(UserspaceIrp);
 
-                if(MatchFound) {
+        DbgPrint("Module %S: status is %x and error code is %x on file %S with major code %x\n",
+            ModuleStruct->ModuleName, FuseNtResp->status, -FuseNtResp->error, UserspaceIrpSp->FileObject->FileName.Buffer, UserspaceIrpSp->MajorFunction);
 
-                    PIO_STACK_LOCATION UserspaceIrpSp;
+        //
+        //  We've found a match. Complete the userspace request
+        //
 
-                    //
-                    //  If the userspace IRP has since been cancelled, remove it from the queue
-                    //
+        UserspaceIrp->IoStatus.Status = FuseNtResp->status;
 
-                    if(UserspaceIrp->Cancel) {
-                        ModuleStruct->OutstandingIrpList = CurrentEntry->Next;
+        if(NT_SUCCESS(FuseNtResp->status)) {
 
-                        if(!ModuleStruct->OutstandingIrpList) {
-                            ModuleStruct->OutstandingIrpListEnd = NULL;
-                        }
+            if(UserspaceIrpSp->MajorFunction == IRP_MJ_CREATE) {
 
-                        return STATUS_CANCELLED;
-                    }
+                //
+                //  The file is open. Keep a reference to the module in the file
+                //  object so that later IRPs on the file don't have to look the
+                //  module up by name; it is dropped when the file is closed
+                //
 
-                    UserspaceIrpSp = IoGetCurrentIrpStackLocation(UserspaceIrp);
+                FuseReferenceModule(ModuleStruct);
+                UserspaceIrpSp->FileObject->FsContext2 = ModuleStruct;
 
-                    DbgPrint("Module %S: status is %x and error code is %x on file %S with major code %x\n",
-                        ModuleStruct->ModuleName, FuseNtResp->status, -FuseNtResp->error, UserspaceIrpSp->FileObject->FileName.Buffer, UserspaceIrpSp->MajorFunction);
+                //
+                //  Clients nearly always ask about a file right after opening
+                //  it, so the module may say up front
+                //
 
-                    //
-                    //  We've found a match. Complete the userspace request
-                    //
+                if(FuseNtResp->params.create.buflen >= sizeof(FUSENT_FILE_INFORMATION) &&
+                    DataLength >= FuseNtResp->params.create.buflen) {
 
-                    UserspaceIrp->IoStatus.Status = FuseNtResp->status;
+                    FuseStashFileInformation(UserspaceIrpSp->FileObject,
+                        (FUSENT_FILE_INFORMATION*) (FuseNtResp + 1), FuseNtResp->params.create.valid_ms);
+                }
 
-                    if(NT_SUCCESS(FuseNtResp->status)) {
+                //
+                //  Names cached as missing in the file's directory may not be
+                //  any more
+                //
 
-                        if(UserspaceIrpSp->MajorFunction == IRP_MJ_READ) {
-                            ULONG BufferLength = FuseNtResp->params.read.buflen;
-                            PVOID ReadBuffer = (&FuseNtResp->params.read.buflen) + 1;
-                            PVOID SystemBuffer = FuseMapUserBuffer(UserspaceIrp);
+                if(FuseCreateMayCreate(UserspaceIrpSp)) {
+                    ULONG FileNameLength;
+                    WCHAR* FileName = FuseCreateFileName(UserspaceIrp, &FileNameLength);
 
-                            if(UserspaceIrpSp->Parameters.Read.Length >= BufferLength) {
-                                memcpy(SystemBuffer, ReadBuffer, BufferLength);
+                    ModuleStruct->MissingNames.InvalidateParent(FileName, FileNameLength / sizeof(WCHAR) - 1);
+                }
 
-                                UserspaceIrp->IoStatus.Information = BufferLength;
-                            } else {
-                                DbgPrint("Read buffer larger than provided buffer. Expected size: %d, actual size: %d for file %S\n",
-                                    BufferLength, UserspaceIrpSp->Parameters.FileSystemControl.OutputBufferLength - sizeof(uint32_t), UserspaceIrpSp->FileObject->FileName.Buffer);
+            } else if(UserspaceIrpSp->MajorFunction == IRP_MJ_READ && Mapped) {
+                ULONG BufferLength = FuseNtResp->params.read.buflen;
 
-                                UserspaceIrp->IoStatus.Status = STATUS_INVALID_BUFFER_SIZE;
-                                Status = STATUS_INVALID_BUFFER_SIZE;
-                            }
-                        } else if(UserspaceIrpSp->MajorFunction == IRP_MJ_WRITE) {
-                            UserspaceIrp->IoStatus.Information = FuseNtResp->params.write.written;
-                        }
-                    }
+                //
+                //  The module read straight into the mapped buffer, so only the
+                //  length comes back
+                //
 
-                    if(UserspaceIrpSp->MajorFunction == IRP_MJ_QUERY_INFORMATION) {
-                        ULONG BufferLength = FuseNtResp->params.query.buflen;
-                        FUSENT_FILE_INFORMATION* FileInformation = (FUSENT_FILE_INFORMATION*) (FuseNtResp + 1);
+                if(UserspaceIrpSp->Parameters.Read.Length >= BufferLength) {
+                    UserspaceIrp->IoStatus.Information = BufferLength;
 
-                        if(BufferLength >= sizeof(FUSENT_FILE_INFORMATION)) {
+                    FuseAdvanceFilePosition(UserspaceIrp, UserspaceIrpSp, BufferLength);
+                } else {
+                    DbgPrint("Module %S claims to have read %d bytes into a buffer of %d for file %S\n",
+                        ModuleStruct->ModuleName, BufferLength, UserspaceIrpSp->Parameters.Read.Length, UserspaceIrpSp->FileObject->FileName.Buffer);
 
-                            Status = FuseCopyInformation(UserspaceIrp, FileInformation, BufferLength);
-                        } else {
-                            DbgPrint("Query information buffer is not as large as expected. Expected: %d, given: %d for file %S\n",
-                                sizeof(FUSENT_FILE_INFORMATION), BufferLength, UserspaceIrpSp->FileObject->FileName.Buffer);
+                    UserspaceIrp->IoStatus.Status = STATUS_INVALID_BUFFER_SIZE;
+                    Status = STATUS_INVALID_BUFFER_SIZE;
+                }
+            } else if(UserspaceIrpSp->MajorFunction == IRP_MJ_READ) {
+                ULONG BufferLength = FuseNtResp->params.read.buflen;
+                PVOID ReadBuffer = (PVOID)(FuseNtResp + 1);
+                PVOID SystemBuffer = FuseMapUserBuffer(UserspaceIrp);
 
-                            UserspaceIrp->IoStatus.Status = STATUS_INVALID_BUFFER_SIZE;
-                            Status = STATUS_INVALID_BUFFER_SIZE;
-                        }
-                    } else if(UserspaceIrpSp->MajorFunction == IRP_MJ_DIRECTORY_CONTROL) {
-                        ULONG BufferLength = FuseNtResp->params.dirctrl.buflen;
-                        PFILE_DIRECTORY_INFORMATION DirectoryInformation = (PFILE_DIRECTORY_INFORMATION) (FuseNtResp + 1);
+                if(UserspaceIrpSp->Parameters.Read.Length >= BufferLength && DataLength >= BufferLength) {
+                    memcpy(SystemBuffer, ReadBuffer, BufferLength);
 
-                        Status = FuseCopyDirectoryControl(UserspaceIrp, DirectoryInformation, BufferLength);
-                    }
+                    UserspaceIrp->IoStatus.Information = BufferLength;
 
-                    IoCompleteRequest(UserspaceIrp, IO_NO_INCREMENT);
+                    FuseAdvanceFilePosition(UserspaceIrp, UserspaceIrpSp, BufferLength);
+                } else {
+                    DbgPrint("Read buffer larger than provided buffer. Expected size: %d, actual size: %d for file %S\n",
+                        BufferLength, UserspaceIrpSp->Parameters.FileSystemControl.OutputBufferLength - sizeof(uint32_t), UserspaceIrpSp->FileObject->FileName.Buffer);
 
-                    //
-                    //  Remove the entry from the outstanding IRP queue
-                    //
+                    UserspaceIrp->IoStatus.Status = STATUS_INVALID_BUFFER_SIZE;
+                    Status = STATUS_INVALID_BUFFER_SIZE;
+                }
+            } else if(UserspaceIrpSp->MajorFunction == IRP_MJ_WRITE) {
+                UserspaceIrp->IoStatus.Information = FuseNtResp->params.write.written;
 
-                    if(PreviousEntry) {
-                        PreviousEntry->Next = PreviousEntry->Next->Next;
-                    } else {
-                        ModuleStruct->OutstandingIrpList = CurrentEntry->Next;
-                    }
+                FuseAdvanceFilePosition(UserspaceIrp, UserspaceIrpSp, FuseNtResp->params.write.written);
+            }
+        }
 
-                    if(!CurrentEntry->Next) {
-                        ModuleStruct->OutstandingIrpListEnd = PreviousEntry;
-                    }
+        //
+        //  The module may say how long a name it didn't find is going to stay
+        //  missing. Opens of it are failed without asking until then, unless
+        //  something is created in its directory first (the ticket taken in
+        //  FuseAddUserspaceIrp says whether something was while it looked)
+        //
 
-                    //
-                    //  Free the entry from memory
-                    //
+        if(UserspaceIrpSp->MajorFunction == IRP_MJ_CREATE && !NT_SUCCESS(FuseNtResp->status) &&
+            FuseNtResp->params.noent.negative_ms != 0 && !FuseCreateMayCreate(UserspaceIrpSp)) {
 
-                    ExFreePool(CurrentEntry);
-                } else {
+            ULONG FileNameLength;
+            WCHAR* FileName = FuseCreateFileName(UserspaceIrp, &FileNameLength);
 
-                    //
-                    //  No userspace IRP with an address matching that given was found,
-                    //  so the module's response is assumed to be invalid
-                    //
+            ModuleStruct->MissingNames.Insert(FileName, FileNameLength / sizeof(WCHAR) - 1, FuseNtResp->status,
+                KeQueryInterruptTime(), (uint64_t) FuseNtResp->params.noent.negative_ms * 10000,
+                (uint32_t) (ULONG_PTR) UserspaceIrp->Tail.Overlay.DriverContext[2]);
+        }
 
-                    DbgPrint("Module %S sent a response but no match for the userspace IRP %x was found\n", ModuleStruct->ModuleName, UserspaceIrp);
+        if(UserspaceIrpSp->MajorFunction == IRP_MJ_QUERY_INFORMATION) {
+            ULONG BufferLength = FuseNtResp->params.query.buflen;
+            FUSENT_FILE_INFORMATION* FileInformation = (FUSENT_FILE_INFORMATION*) (FuseNtResp + 1);
 
-                    Status = STATUS_INVALID_DEVICE_REQUEST;
-                }
+            if(BufferLength >= sizeof(FUSENT_FILE_INFORMATION) && DataLength >= BufferLength) {
+
+                Status = FuseCopyInformation(UserspaceIrp, FileInformation, BufferLength);
+            } else {
+                DbgPrint("Query information buffer is not as large as expected. Expected: %d, given: %d for file %S\n",
+                    sizeof(FUSENT_FILE_INFORMATION), BufferLength, UserspaceIrpSp->FileObject->FileName.Buffer);
+
+                UserspaceIrp->IoStatus.Status = STATUS_INVALID_BUFFER_SIZE;
+                Status = STATUS_INVALID_BUFFER_SIZE;
+            }
+        } else if(UserspaceIrpSp->MajorFunction == IRP_MJ_DIRECTORY_CONTROL) {
+            ULONG BufferLength = FuseNtResp->params.dirctrl.buflen;
+            PFILE_DIRECTORY_INFORMATION DirectoryInformation = (PFILE_DIRECTORY_INFORMATION) (FuseNtResp + 1);
+
+            if(DataLength >= BufferLength) {
+                Status = FuseCopyDirectoryControl(UserspaceIrp, DirectoryInformation, BufferLength);
+            } else {
+                UserspaceIrp->IoStatus.Status = STATUS_INVALID_BUFFER_SIZE;
+                Status = STATUS_INVALID_BUFFER_SIZE;
             }
         }
 
+        IoCompleteRequest(UserspaceIrp, IO_NO_INCREMENT);
     } else {
 
-        DbgPrint("Response from %S has a bad user buffer. Expected size: %d. Actual size: %d\n",
-            ModuleStruct->ModuleName, sizeof(FUSENT_RESP), IrpSp->Parameters.DeviceIoControl.InputBufferLength);
+        //
+        //  No outstanding userspace IRP matches the request ID and pointer
+        //  given, so the module's response is assumed to be invalid
+        //
 
-        Status = STATUS_INVALID_BUFFER_SIZE;
+        DbgPrint("Module %S sent a response but no match for the userspace IRP %x (request %I64x) was found\n",
+            ModuleStruct->ModuleName, UserspaceIrp, FuseNtResp->reqid);
+
+        Status = STATUS_INVALID_DEVICE_REQUEST;
     }
 
     return Status;
@@ -610,25 +1228,110 @@ FuseCheckUnmountModule (
 {
     if(IrpSp->FileObject->FileName.Length > 0) {
         WCHAR* ModuleName = IrpSp->FileObject->FileName.Buffer + 1;
-        PMODULE_STRUCT ModuleStruct = (PMODULE_STRUCT) hmap_get(&ModuleMap, ModuleName);
+        PMODULE_STRUCT ModuleStruct = FuseLookupModule(ModuleName);
+        BOOLEAN Dismounted = FALSE;
 
         if(ModuleStruct && ModuleStruct->ModuleFileObject == IrpSp->FileObject) {
 
             DbgPrint("Dismounting module %S, as the last reference to its handle has been lost\n", ModuleName);
 
             //
-            //  The file object matches, so perform a dismount
+            //  The file object matches, so perform a dismount. Removing the module
+            //  from the map drops the map's reference, but files may still be open
+            //  on it; cancel everything it has queued now rather than when the last
+            //  of them is closed
             //
 
-            hmap_remove(&ModuleMap, ModuleName);
+            if(ModuleMap.Remove(ModuleName, NULL)) {
+                FuseDereferenceModule(ModuleStruct);
+            }
+
+            FuseRundownModule(ModuleStruct);
+            Dismounted = TRUE;
+        }
 
-            return TRUE;
+        if(ModuleStruct) {
+            FuseDereferenceModule(ModuleStruct);
         }
+
+        return Dismounted;
     }
 
     return FALSE;
 }
 
+static NTSTATUS
+FuseReadMountSetup (
+    IN PIRP Irp,
+    IN PIO_STACK_LOCATION IrpSp,
+    OUT FUSENT_MOUNT_SETUP* Setup
+    )
+//
+//  Copies in the input to an IRP_FUSE_MOUNT, which is METHOD_NEITHER and so still in
+//  the module's context. The module may send a FUSENT_MOUNT_SETUP, one without the
+//  I/O limits at the end, the bare FUSENT_RING_SETUP that came before it, or nothing;
+//  whatever it leaves out (or whatever fails to be copied) reads as zero
+//
+{
+    ULONG Length = IrpSp->Parameters.FileSystemControl.InputBufferLength;
+
+    RtlZeroMemory(Setup, sizeof(FUSENT_MOUNT_SETUP));
+
+    if(Length == 0) {
+        return STATUS_SUCCESS;
+    }
+
+    if(Length != sizeof(FUSENT_RING_SETUP) && Length < FIELD_OFFSET(FUSENT_MOUNT_SETUP, max_read)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if(Length > sizeof(FUSENT_MOUNT_SETUP)) {
+        Length = sizeof(FUSENT_MOUNT_SETUP);
+    }
+
+    try {
+        if(Irp->RequestorMode != KernelMode) {
+            ProbeForRead(IrpSp->Parameters.FileSystemControl.Type3InputBuffer, Length, sizeof(ULONG));
+        }
+
+        memcpy(Setup, IrpSp->Parameters.FileSystemControl.Type3InputBuffer, Length);
+    } catch (...) {
+        RtlZeroMemory(Setup, sizeof(FUSENT_MOUNT_SETUP));
+
+        return STATUS_INVALID_USER_BUFFER;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static ULONG
+FuseIoLimit (
+    IN uint32_t Limit
+    )
+//
+//  Returns the piece size to split reads or writes into for a module that asked for
+//  no more than Limit bytes at a time: whole pages, so that the pieces' buffers line
+//  up with the original's, and no less than one
+//
+{
+    if(!Limit) {
+        return 0;
+    }
+
+    return Limit < PAGE_SIZE ? PAGE_SIZE : Limit & ~(PAGE_SIZE - 1);
+}
+
+static WCHAR
+FuseUpcaseChar (
+    IN WCHAR Char
+    )
+//
+//  Folds a character of a name on a module that ignores case
+//
+{
+    return RtlUpcaseUnicodeChar(Char);
+}
+
 __drv_aliasesMem
 NTSTATUS
 FuseFsdFileSystemControl (
@@ -654,12 +1357,19 @@ FuseFsdFileSystemControl (
     //  for work from userspace applications. When work comes in in the
     //  form of CreateFiles, ReadFiles, WriteFiles, etc., the driver hands
     //  off requests to the module by filling out and then completing IRPs,
-    //  which signals to the module that there is work to be done
+    //  which signals to the module that there is work to be done. With
+    //  IRP_FUSE_MODULE_REQUEST_BATCH instead, each completed IRP carries
+    //  as many of the queued requests as fit in its buffer
     //
     //  When a module completes work, it calls NtFsControlFile with
     //  IRP_FUSE_MODULE_RESPONSE, and the IRP for the corresponding
     //  CreateFile, ReadFile, WriteFile, etc. is filled out using the
-    //  response from the module and then completed
+    //  response from the module and then completed. A module can also
+    //  hand back many responses at once with IRP_FUSE_MODULE_RESPONSE_BATCH
+    //
+    //  A module can instead mount with shared-memory rings (see fusering.cc),
+    //  in which case requests and responses go through those, and the module
+    //  only calls down with IRP_FUSE_MODULE_RING_DOORBELL to wake the driver
     //
 
     if(IrpSp->FileObject->FileName.Length <= 1) {
@@ -674,6 +1384,7 @@ FuseFsdFileSystemControl (
         WCHAR* ModuleName = IrpSp->FileObject->FileName.Buffer + 1;
         ULONG ModuleNameLength = sizeof(WCHAR) * (IrpSp->FileObject->FileName.Length - 1);
         PMODULE_STRUCT ModuleStruct;
+        FUSENT_MOUNT_SETUP Setup;
 
         DbgPrint("A mount has been requested for module %S\n", ModuleName);
 
@@ -682,9 +1393,93 @@ FuseFsdFileSystemControl (
         //  module hash map
         //
 
-        ModuleStruct = (PMODULE_STRUCT) ExAllocatePoolWithTag(PagedPool, sizeof(MODULE_STRUCT), M_FUSE);
+        ModuleStruct = (PMODULE_STRUCT) ExAllocatePoolWithTag(NonPagedPool, sizeof(MODULE_STRUCT), M_FUSE);
         RtlZeroMemory(ModuleStruct, sizeof(MODULE_STRUCT));
         ExInitializeFastMutex(&ModuleStruct->ModuleLock);
+        ExInitializeRundownProtection(&ModuleStruct->Rundown);
+
+        //
+        //  This reference belongs to the module map
+        //
+
+        ModuleStruct->RefCount = 1;
+
+        //
+        //  Give the IRP queue a shard per processor
+        //
+
+        if(!ModuleStruct->IrpQueue.Init(KeNumberProcessors)) {
+            DbgPrint("Out of memory setting up module %S\n", ModuleName);
+
+            ExFreePool(ModuleStruct);
+
+            Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+            IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        if(!ModuleStruct->MissingNames.Init()) {
+            DbgPrint("Out of memory setting up module %S\n", ModuleName);
+
+            ModuleStruct->IrpQueue.Destroy(FuseCompleteCancelledIrp);
+            ExFreePool(ModuleStruct);
+
+            Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+            IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        //
+        //  See what the module asked for. A module that asks for nothing gets
+        //  FUSENT_REQs over the FSCTLs
+        //
+
+        if(!NT_SUCCESS(FuseReadMountSetup(Irp, IrpSp, &Setup))) {
+            DbgPrint("Module %S sent a bad mount setup; ignoring it\n", ModuleName);
+        }
+
+        ModuleStruct->ProtocolVersion = min(Setup.version, FUSENT_PROTO_VERSION);
+
+        //
+        //  The mount comes from the module itself (it is METHOD_NEITHER), so this
+        //  is the process to map buffers into
+        //
+
+        ModuleStruct->ModuleProcess = PsGetCurrentProcess();
+        ObReferenceObject(ModuleStruct->ModuleProcess);
+
+        //
+        //  Larger reads and writes than the module asked for are split up
+        //
+
+        if(ModuleStruct->ProtocolVersion >= FUSENT_PROTO_SPLIT) {
+            ModuleStruct->MaxRead = FuseIoLimit(Setup.max_read);
+            ModuleStruct->MaxWrite = FuseIoLimit(Setup.max_write);
+        }
+
+        //
+        //  A module that ignores case misses a name however it's spelled, and a
+        //  create in a directory is one however the directory's spelled
+        //
+
+        if(Setup.flags & FUSENT_MOUNT_CASE_INSENSITIVE) {
+            ModuleStruct->MissingNames.IgnoreCase(FuseUpcaseChar);
+        }
+
+        //
+        //  Set up the shared-memory rings if the module asked for them. If they
+        //  can't be set up, the module carries on with the FSCTLs
+        //
+
+        if(Setup.ring.region) {
+            NTSTATUS RingStatus = FuseSetupRing(ModuleStruct, Irp, &Setup.ring);
+
+            if(!NT_SUCCESS(RingStatus)) {
+                DbgPrint("Could not set up rings for module %S (%x); using FSCTLs\n", ModuleName, RingStatus);
+            }
+        }
 
         //
         //  Store the module's file object so that we can later verify that the
@@ -696,16 +1491,34 @@ FuseFsdFileSystemControl (
         ModuleStruct->ModuleName = (WCHAR*) ExAllocatePoolWithTag(PagedPool, ModuleNameLength + sizeof(WCHAR), M_FUSE);
         memcpy(ModuleStruct->ModuleName, ModuleName, ModuleNameLength);
         ModuleStruct->ModuleName[ModuleNameLength] = L'\0';
-        hmap_add(&ModuleMap, ModuleStruct->ModuleName, ModuleStruct);
 
-        Status = STATUS_SUCCESS;
+        if(!ModuleMap.Insert(ModuleStruct->ModuleName, ModuleStruct)) {
+            DbgPrint("Could not add module %S to the module map; is it already mounted?\n", ModuleName);
+
+            Status = STATUS_OBJECT_NAME_COLLISION;
+
+            FuseDereferenceModule(ModuleStruct);
+        } else if(ModuleStruct->Ring) {
+
+            //
+            //  Tell the module that it has rings
+            //
+
+            Irp->IoStatus.Information = sizeof(FUSENT_RING_SETUP);
+        }
+
+        Irp->IoStatus.Status = Status;
         IoCompleteRequest(Irp, IO_NO_INCREMENT);
 
     } else if(IrpSp->Parameters.FileSystemControl.FsControlCode == IRP_FUSE_MODULE_REQUEST ||
-        IrpSp->Parameters.FileSystemControl.FsControlCode == IRP_FUSE_MODULE_RESPONSE) {
+        IrpSp->Parameters.FileSystemControl.FsControlCode == IRP_FUSE_MODULE_REQUEST_BATCH ||
+        IrpSp->Parameters.FileSystemControl.FsControlCode == IRP_FUSE_MODULE_RESPONSE ||
+        IrpSp->Parameters.FileSystemControl.FsControlCode == IRP_FUSE_MODULE_RESPONSE_BATCH ||
+        IrpSp->Parameters.FileSystemControl.FsControlCode == IRP_FUSE_MODULE_RING_DOORBELL ||
+        IrpSp->Parameters.FileSystemControl.FsControlCode == IRP_FUSE_MODULE_WAKE) {
 
         WCHAR* ModuleName = IrpSp->FileObject->FileName.Buffer + 1;
-        PMODULE_STRUCT ModuleStruct = (PMODULE_STRUCT) hmap_get(&ModuleMap, ModuleName);
+        PMODULE_STRUCT ModuleStruct = FuseLookupModule(ModuleName);
 
         //
         //  Verify that whoever is making the request is using the same file handle that
@@ -718,17 +1531,29 @@ FuseFsdFileSystemControl (
             Status = STATUS_INVALID_PARAMETER;
         } else if(ModuleStruct->ModuleFileObject == IrpSp->FileObject) {
 
-            if(IrpSp->Parameters.FileSystemControl.FsControlCode == IRP_FUSE_MODULE_REQUEST) {
+            if(IrpSp->Parameters.FileSystemControl.FsControlCode == IRP_FUSE_MODULE_REQUEST ||
+                IrpSp->Parameters.FileSystemControl.FsControlCode == IRP_FUSE_MODULE_REQUEST_BATCH) {
 
 #ifdef FUSE_DEBUG0
                 DbgPrint("Received request for work from module %S\n", ModuleName);
 #endif
 
                 //
-                //  Save IRP in module struct and check if there is a userspace request to give it
+                //  Queue the IRP for the module; if there is a userspace request waiting, it
+                //  is handed off (and the IRP completed) right away
                 //
 
-                if(!FuseAddIrpToModuleList(Irp, ModuleStruct, TRUE)) {
+                if(!ExAcquireRundownProtection(&ModuleStruct->Rundown)) {
+
+                    //
+                    //  The module is being dismounted
+                    //
+
+                    Status = STATUS_NO_SUCH_DEVICE;
+                    Irp->IoStatus.Status = Status;
+                    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+                } else if(!FuseAddIrpToModuleList(Irp, ModuleStruct, TRUE)) {
+                    ExReleaseRundownProtection(&ModuleStruct->Rundown);
 
                     DbgPrint("Module %S supplied bad buffer; bailing\n", ModuleStruct->ModuleName);
 
@@ -738,16 +1563,49 @@ FuseFsdFileSystemControl (
 
                     Status = STATUS_INVALID_USER_BUFFER;
                     IoCompleteRequest(Irp, IO_NO_INCREMENT);
-                } else if(!FuseCheckForWork(ModuleStruct, Irp)) {
-
-                    //
-                    //  We only need to mark the IRP as pending if it there was no work for it
-                    //
+                } else {
+                    ExReleaseRundownProtection(&ModuleStruct->Rundown);
 
-                    FusePrePostIrp(Irp);
-                    IoMarkIrpPending(Irp);
                     Status = STATUS_PENDING;
                 }
+            } else if(IrpSp->Parameters.FileSystemControl.FsControlCode == IRP_FUSE_MODULE_RING_DOORBELL) {
+
+                //
+                //  Take in the module's responses and hand it any backlogged work
+                //
+
+                if(!ExAcquireRundownProtection(&ModuleStruct->Rundown)) {
+                    Status = STATUS_NO_SUCH_DEVICE;
+                } else {
+                    if(ModuleStruct->Ring) {
+                        Status = FuseRingDoorbell(ModuleStruct);
+                    } else {
+                        Status = STATUS_INVALID_DEVICE_REQUEST;
+                    }
+
+                    ExReleaseRundownProtection(&ModuleStruct->Rundown);
+                }
+
+                Irp->IoStatus.Status = Status;
+                IoCompleteRequest(Irp, IO_NO_INCREMENT);
+            } else if(IrpSp->Parameters.FileSystemControl.FsControlCode == IRP_FUSE_MODULE_WAKE) {
+
+                //
+                //  Hand the calling thread back its idle requests for work, so that
+                //  a thread that is going away can have its buffers back
+                //
+
+                if(!ExAcquireRundownProtection(&ModuleStruct->Rundown)) {
+                    Status = STATUS_NO_SUCH_DEVICE;
+                } else {
+                    FuseReleaseModuleIrps(ModuleStruct, Irp->Tail.Overlay.Thread);
+                    Status = STATUS_SUCCESS;
+
+                    ExReleaseRundownProtection(&ModuleStruct->Rundown);
+                }
+
+                Irp->IoStatus.Status = Status;
+                IoCompleteRequest(Irp, IO_NO_INCREMENT);
             } else {
 
 #ifdef FUSE_DEBUG0
@@ -779,6 +1637,10 @@ FuseFsdFileSystemControl (
             Status = STATUS_INVALID_PARAMETER;
             IoCompleteRequest(Irp, IO_NO_INCREMENT);
         }
+
+        if(ModuleStruct) {
+            FuseDereferenceModule(ModuleStruct);
+        }
     } else {
         Status = STATUS_INVALID_PARAMETER;
         IoCompleteRequest(Irp, IO_NO_INCREMENT);
@@ -811,9 +1673,24 @@ FuseFsdClose (
     )
 {
     PIO_STACK_LOCATION IrpSp;
+    PMODULE_STRUCT ModuleStruct;
     IrpSp = IoGetCurrentIrpStackLocation(Irp);
 
-    FuseCheckUnmountModule(IrpSp);
+    ModuleStruct = (PMODULE_STRUCT) IrpSp->FileObject->FsContext2;
+
+    if(ModuleStruct) {
+
+        //
+        //  A file opened on a module; drop the reference it held
+        //
+
+        IrpSp->FileObject->FsContext2 = NULL;
+        FuseDereferenceModule(ModuleStruct);
+
+        FuseFreeFileContext(IrpSp->FileObject);
+    } else {
+        FuseCheckUnmountModule(IrpSp);
+    }
 
 #ifdef FUSE_DEBUG1
     DbgPrint("FuseFsdClose called on '%wZ'\n", &IrpSp->FileObject->FileName);
@@ -861,6 +1738,10 @@ FuseFsdRead (
         return STATUS_SUCCESS;
     }
 
+    if(FuseSplitIrp(VolumeDeviceObject, Irp, IrpSp)) {
+        return STATUS_PENDING;
+    }
+
     return FuseAddUserspaceIrp(Irp, IrpSp);
 }
 
@@ -887,6 +1768,12 @@ FuseFsdWrite (
         return STATUS_SUCCESS;
     }
 
+    FuseInvalidateFileInformation(IrpSp->FileObject);
+
+    if(FuseSplitIrp(VolumeDeviceObject, Irp, IrpSp)) {
+        return STATUS_PENDING;
+    }
+
     return FuseAddUserspaceIrp(Irp, IrpSp);
 }
 
@@ -972,11 +1859,27 @@ FuseFsdQueryInformation (
     )
 {
     PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
+    FUSENT_FILE_INFORMATION FileInformation;
+    NTSTATUS Status;
 
 #ifdef FUSE_DEBUG1
     DbgPrint("FuseFsdQueryInformation called on '%wZ'\n", &IrpSp->FileObject->FileName);
 #endif
 
+    //
+    //  Answer from what the module reported when the file was opened, if
+    //  that still holds
+    //
+
+    if(FuseLookupFileInformation(IrpSp->FileObject, &FileInformation)) {
+        Status = FuseCopyInformation(Irp, &FileInformation, sizeof(FUSENT_FILE_INFORMATION));
+
+        Irp->IoStatus.Status = Status;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+        return Status;
+    }
+
     return FuseAddUserspaceIrp(Irp, IrpSp);
 }
 
@@ -986,9 +1889,23 @@ FuseFsdSetInformation (
     IN PIRP Irp
     )
 {
+    PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
+    PMODULE_STRUCT ModuleStruct = (PMODULE_STRUCT) IrpSp->FileObject->FsContext2;
+    FILE_INFORMATION_CLASS FileInformationClass = IrpSp->Parameters.SetFile.FileInformationClass;
+
 #ifdef FUSE_DEBUG1
     DbgPrint("FuseFsdSetInformation\n");
 #endif
+
+    //
+    //  A rename or link may put a name into any directory on the module,
+    //  without anything being created there, so forget every missing name
+    //
+
+    if(ModuleStruct && (FileInformationClass == FileRenameInformation || FileInformationClass == FileLinkInformation)) {
+        ModuleStruct->MissingNames.InvalidateAll();
+    }
+
     return STATUS_SUCCESS;
 }
 
@@ -1055,11 +1972,29 @@ FuseFastQueryBasicInfo (
     OUT PIO_STATUS_BLOCK IoStatus,
     IN PDEVICE_OBJECT DeviceObject
     )
+//
+//  The fast I/O queries are answered from the information kept from the
+//  create (see FuseLookupFileInformation); without it, returning FALSE has
+//  the I/O manager send an IRP instead. Looking the information up may block
+//  on the context map and the context's lock, so a caller that can't wait
+//  gets the IRP too
+//
 {
+    FUSENT_FILE_INFORMATION FileInformation;
+    LONG Length = sizeof(FILE_BASIC_INFORMATION);
+
 #ifdef FUSE_DEBUG1
     DbgPrint("FuseFastQueryBasicInfo\n");
 #endif
-    return FALSE;
+
+    if(!Wait || !FuseLookupFileInformation(FileObject, &FileInformation)) {
+        return FALSE;
+    }
+
+    IoStatus->Status = FuseQueryBasicInfo(Buffer, &FileInformation, sizeof(FUSENT_FILE_INFORMATION), &Length);
+    IoStatus->Information = sizeof(FILE_BASIC_INFORMATION) - Length;
+
+    return TRUE;
 }
 
 BOOLEAN
@@ -1071,9 +2006,21 @@ FuseFastQueryStdInfo (
     IN PDEVICE_OBJECT DeviceObject
     )
 {
+    FUSENT_FILE_INFORMATION FileInformation;
+    LONG Length = sizeof(FILE_STANDARD_INFORMATION);
+
+#ifdef FUSE_DEBUG1
     DbgPrint("FuseFastQueryStdInfo\n");
+#endif
 
-    return FALSE;
+    if(!Wait || !FuseLookupFileInformation(FileObject, &FileInformation)) {
+        return FALSE;
+    }
+
+    IoStatus->Status = FuseQueryStandardInfo(Buffer, &FileInformation, sizeof(FUSENT_FILE_INFORMATION), &Length);
+    IoStatus->Information = sizeof(FILE_STANDARD_INFORMATION) - Length;
+
+    return TRUE;
 }
 
 BOOLEAN
@@ -1085,8 +2032,21 @@ FuseFastQueryNetworkOpenInfo (
     IN PDEVICE_OBJECT DeviceObject
     )
 {
+    FUSENT_FILE_INFORMATION FileInformation;
+    LONG Length = sizeof(FILE_NETWORK_OPEN_INFORMATION);
+
+#ifdef FUSE_DEBUG1
     DbgPrint("FuseFastQueryNetworkOpenInfo\n");
-    return FALSE;
+#endif
+
+    if(!Wait || !FuseLookupFileInformation(FileObject, &FileInformation)) {
+        return FALSE;
+    }
+
+    IoStatus->Status = FuseQueryNetworkOpenInfo(Buffer, &FileInformation, sizeof(FUSENT_FILE_INFORMATION), &Length);
+    IoStatus->Information = sizeof(FILE_NETWORK_OPEN_INFORMATION) - Length;
+
+    return TRUE;
 }
 
 BOOLEAN
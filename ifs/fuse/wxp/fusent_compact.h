@@ -0,0 +1,139 @@
+/*++
+
+Copyright (c) 2011 FUSE-NT Authors
+
+Module Name:
+
+    fusent_compact.h
+
+Abstract:
+
+    This module defines the compact request format the driver sends modules
+    that ask for it. The module side has its own copy of this file.
+
+--*/
+
+// The compact request format.
+//
+// The original FUSENT_REQ carries the userspace IRP by value followed by all
+// of its stack locations, of which a module looks at a handful of fields in
+// one of them. A module that asks for protocol version FUSENT_PROTO_COMPACT
+// or later at mount time instead gets each request as a fixed-layout
+// FUSENT_COMPACT_REQ holding just those fields, followed by its payload (the
+// file name of a create, or the data of a write). The driver marks records
+// in this format with FUSENT_REQ_COMPACT in their FUSENT_REQ_HDR, so a
+// module can tell which format it has even without knowing what the driver
+// agreed to.
+//
+// A module that asks for FUSENT_PROTO_MAPPED or later may get large writes
+// without their data: the driver maps the writer's locked pages into the
+// module's address space instead, and the payload is a FUSENT_COMPACT_MAPPING
+// saying where (the request has FUSENT_COMPACT_MAPPED set). The mapping lasts
+// until the module responds to the request, and is the writer's own memory,
+// so the module must only read from it.
+//
+// With FUSENT_PROTO_MAPPED_READ, large reads come the same way, mapping the
+// reader's buffer. The module reads the file straight into it and responds
+// with just the number of bytes read (params.read.buflen), no data following.
+//
+// With FUSENT_PROTO_SPLIT, large reads and writes may arrive split up (see
+// FUSENT_MOUNT_SETUP), and the driver keeps the position of files opened for
+// synchronous I/O itself. A read or write with FUSENT_COMPACT_ABSOLUTE set is
+// at exactly its offset, even if that is zero on such a file. Each piece of a
+// split request has FUSENT_COMPACT_PIECE set; the pieces of one request are
+// sent at once, and may be handled in any order.
+//
+// The layout is the same for 32- and 64-bit code: the IRP and file object
+// pointers are only ever handed back to the driver or used as keys, so they
+// travel as 64-bit integers.
+//
+// Nothing in here depends on the kernel or on Windows. The includer supplies
+// uint64_t, uint32_t, uint16_t and uint8_t.
+
+#ifndef FUSENT_COMPACT_H
+#define FUSENT_COMPACT_H
+
+#include <string.h>
+
+// Protocol versions a module can ask for (see FUSENT_MOUNT_SETUP):
+#define FUSENT_PROTO_LEGACY 0 // FUSENT_REQ
+#define FUSENT_PROTO_COMPACT 1 // FUSENT_COMPACT_REQ
+#define FUSENT_PROTO_MAPPED 2 // and large writes as FUSENT_COMPACT_MAPPING
+#define FUSENT_PROTO_MAPPED_READ 3 // and large reads as well
+#define FUSENT_PROTO_SPLIT 4 // and large reads and writes split up
+#define FUSENT_PROTO_VERSION FUSENT_PROTO_SPLIT // newest
+
+// FUSENT_REQ_HDR flags:
+#define FUSENT_REQ_COMPACT 0x100 // the record holds a FUSENT_COMPACT_REQ
+
+// FUSENT_COMPACT_REQ flags. The low byte is the Flags of the IRP's current
+// stack location (SL_RESTART_SCAN and friends), as it stands:
+#define FUSENT_COMPACT_SL_FLAGS 0x00ff
+#define FUSENT_COMPACT_SYNCHRONOUS 0x0100 // IRP_SYNCHRONOUS_API
+#define FUSENT_COMPACT_MAPPED 0x0200 // the payload is a FUSENT_COMPACT_MAPPING
+#define FUSENT_COMPACT_ABSOLUTE 0x0400 // offset is never the file position's stand-in
+#define FUSENT_COMPACT_PIECE 0x0800 // one piece of a read or write the driver split up
+
+typedef struct _FUSENT_COMPACT_REQ {
+	uint64_t reqid; // echo back in FUSENT_RESP
+	uint64_t irp; // the userspace IRP; echo back in FUSENT_RESP
+	uint64_t file; // the file object the request is on
+	uint64_t offset; // read/write ByteOffset
+	uint32_t length; // read/write Length, or the query buffer's
+	uint32_t options; // create Options, or the query's information class
+	uint32_t datalen; // of the payload following the request
+	uint16_t flags; // FUSENT_COMPACT_ flags
+	uint8_t major; // IRP_MJ_ function
+	uint8_t minor; // IRP_MN_ function
+} FUSENT_COMPACT_REQ;
+
+// Where the buffer of a mapped read or write is in the module's address space:
+typedef struct _FUSENT_COMPACT_MAPPING {
+	uint64_t addr;
+	uint32_t len;
+	uint32_t reserved;
+} FUSENT_COMPACT_MAPPING;
+
+// Returns the number of bytes a request with datalen bytes of payload takes
+// up (not counting any FUSENT_REQ_HDR or padding in a batch):
+static inline uint32_t fusent_compact_len(uint32_t datalen)
+{
+	return sizeof(FUSENT_COMPACT_REQ) + datalen;
+}
+
+// Writes req and its req->datalen bytes of payload into buf. data may be
+// NULL to leave the payload for the caller to fill in.
+//
+// Returns the number of bytes written, or 0 if they don't fit in buflen.
+static inline uint32_t fusent_compact_encode(void *buf, uint32_t buflen,
+		const FUSENT_COMPACT_REQ *req, const void *data)
+{
+	if (buflen < sizeof(FUSENT_COMPACT_REQ) ||
+			req->datalen > buflen - sizeof(FUSENT_COMPACT_REQ))
+		return 0;
+
+	memcpy(buf, req, sizeof(FUSENT_COMPACT_REQ));
+	if (data)
+		memcpy((uint8_t *)buf + sizeof(FUSENT_COMPACT_REQ), data, req->datalen);
+
+	return fusent_compact_len(req->datalen);
+}
+
+// Finds the request and its payload in the len bytes at buf, checking that
+// the payload is all there.
+//
+// Returns the request, or NULL if the record is malformed.
+static inline const FUSENT_COMPACT_REQ *fusent_compact_decode(const void *buf,
+		uint32_t len, const void **data)
+{
+	const FUSENT_COMPACT_REQ *req = (const FUSENT_COMPACT_REQ *)buf;
+
+	if (len < sizeof(FUSENT_COMPACT_REQ) ||
+			req->datalen > len - sizeof(FUSENT_COMPACT_REQ))
+		return NULL;
+
+	*data = req + 1;
+	return req;
+}
+
+#endif /* FUSENT_COMPACT_H */
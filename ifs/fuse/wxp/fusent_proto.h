@@ -18,6 +18,7 @@ Abstract:
 
 #include "basictypes.h"
 #include <ntdef.h>
+#include "fusent_compact.h"
 
 //
 //  NtFsControlFile FSCTL codes. These functions codes are chosen to be
@@ -40,13 +41,45 @@ Abstract:
 // requests to them
 #define IRP_FUSE_MODULE_REQUEST CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 3133, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
+// The control code for a batched request for work by a module to the
+// driver. Like IRP_FUSE_MODULE_REQUEST, but the driver fills the buffer with
+// as many queued requests as fit, each one preceded by a FUSENT_REQ_HDR
+#define IRP_FUSE_MODULE_REQUEST_BATCH CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 3134, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// The control code for a batch of responses from a module to the driver.
+// Like IRP_FUSE_MODULE_RESPONSE, but the buffer holds any number of
+// FUSENT_RESPs, each one preceded by a FUSENT_RESP_HDR
+#define IRP_FUSE_MODULE_RESPONSE_BATCH CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 3135, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// The control code a module that mounted with shared-memory rings (see
+// FUSENT_RING_SETUP) uses to wake the driver: when it publishes responses
+// into an empty completion ring, and when it makes room in the submission
+// ring while the driver is waiting for room (FUSENT_RING_WAITING). It takes
+// no buffers
+#define IRP_FUSE_MODULE_RING_DOORBELL CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 3136, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// The control code a module uses to have all of its requests for work that
+// are still waiting in the driver completed with nothing in them (an
+// Information of zero), so that a thread that posted some can go away. Any
+// thread that still wants work simply posts again. It takes no buffers
+#define IRP_FUSE_MODULE_WAKE CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 3137, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
 //
 // Requests from Kernel to Userspace
 //
+// Every request carries an opaque reqid naming it in the driver's table of
+// outstanding requests; the response must carry the same reqid (and pirp)
+// or the driver will reject it.
+//
+// Requests come as a FUSENT_REQ (with the FUSENT_CREATE_REQ and
+// FUSENT_WRITE_REQ variants) unless the module asked for the compact format
+// at mount time; see fusent_compact.h.
+//
 
 typedef struct _FUSENT_REQ {
 	PIRP pirp;
 	PFILE_OBJECT fop;
+	uint64_t reqid; // echo back in FUSENT_RESP
 	IRP irp;
 	IO_STACK_LOCATION iostack[0];
 } FUSENT_REQ;
@@ -54,6 +87,7 @@ typedef struct _FUSENT_REQ {
 typedef struct _FUSENT_CREATE_REQ {
 	PIRP pirp;
 	PFILE_OBJECT fop;
+	uint64_t reqid; // echo back in FUSENT_RESP
 	IRP irp;
 	IO_STACK_LOCATION iostack[0];
 
@@ -62,13 +96,10 @@ typedef struct _FUSENT_CREATE_REQ {
 	// uint16_t fname[0]; // fnamelen bytes of UTF-16LE file name
 } FUSENT_CREATE_REQ;
 
-// Takes a FUSE_CREATE_REQ and finds the variably-located fields:
-void fusent_decode_request_create(FUSENT_CREATE_REQ *req, uint32_t *outfnamelen,
-		uint16_t **outfnamep);
-
 typedef struct _FUSENT_WRITE_REQ {
 	PIRP pirp;
 	PFILE_OBJECT fop;
+	uint64_t reqid; // echo back in FUSENT_RESP
 	IRP irp;
 	IO_STACK_LOCATION iostack[0];
 
@@ -77,9 +108,38 @@ typedef struct _FUSENT_WRITE_REQ {
 	// uint8_t buf[0]; // buflen bytes of write data
 } FUSENT_WRITE_REQ;
 
-// Takes a FUSE_WRITE_REQ and finds the variably-located fields:
-void fusent_decode_request_write(FUSENT_WRITE_REQ *req, uint32_t *outbuflen,
-		uint8_t **outbufp);
+// Header before each request in an IRP_FUSE_MODULE_REQUEST_BATCH buffer.
+// reclen covers the header, the request and the padding after it, and is a
+// multiple of FUSENT_BATCH_ALIGN; the next header starts reclen bytes on.
+// flags says which format the request is in (FUSENT_REQ_COMPACT).
+#define FUSENT_BATCH_ALIGN 8
+
+typedef struct _FUSENT_REQ_HDR {
+	uint32_t reclen;
+	uint32_t flags;
+} FUSENT_REQ_HDR;
+
+// A request in either format, as a module sees it once decoded:
+typedef struct _FUSENT_REQ_INFO {
+	uint64_t reqid;
+	PIRP pirp;
+	PFILE_OBJECT fop;
+	uint8_t major;
+	uint8_t minor;
+	uint16_t flags; // FUSENT_COMPACT_ flags
+	uint32_t length;
+	uint32_t options;
+	LARGE_INTEGER offset;
+	uint32_t datalen;
+	void *data; // the file name of a create, or the data of a write
+} FUSENT_REQ_INFO;
+
+// Takes the request following a FUSENT_REQ_HDR, in whichever format the
+// header says, and fills in info. The request must stay put while info is
+// in use.
+//
+// Returns non-negative on success, or negative if the request is malformed.
+int fusent_decode_request(FUSENT_REQ_HDR *hdr, FUSENT_REQ_INFO *info);
 
 //
 // Responses (Userspace to Kernelspace)
@@ -94,6 +154,45 @@ typedef struct _FUSENT_MOUNT { // weird special-case "response"
 	// mtopts aligned)
 } FUSENT_MOUNT;
 
+// Optional input to IRP_FUSE_MOUNT from a module that wants requests and
+// responses to go through shared-memory rings (see fusent_ring.h) instead of
+// an FSCTL each way. The region is the module's own memory, laid out with
+// fusent_ring_region_init(); the driver locks it down for as long as the
+// module is mounted. A driver that sets the rings up says so by returning
+// sizeof(FUSENT_RING_SETUP) in the IRP's Information; otherwise the module
+// carries on with IRP_FUSE_MODULE_REQUEST_BATCH and friends.
+typedef struct _FUSENT_RING_SETUP {
+	PVOID region;
+	uint32_t length; // of the region
+	HANDLE sqevent; // event the driver sets when the submission ring stops being empty
+} FUSENT_RING_SETUP;
+
+// The full input to IRP_FUSE_MOUNT, of which a FUSENT_RING_SETUP on its own
+// is the older, shorter form. A module that doesn't want rings leaves
+// ring.region NULL. The driver sends requests in the newest format it knows
+// of no later than version (see fusent_compact.h); one that predates this
+// struct sends FUSENT_REQs.
+//
+// From FUSENT_PROTO_SPLIT on, the driver splits reads and writes larger than
+// max_read and max_write into pieces no larger than that, which the module
+// may be handed at the same time, and completes the original once they are
+// all done. Zero means no limit. A module that predates these fields sends
+// the struct without them.
+//
+// A module that looks names up ignoring case (-o case_insensitive) sets
+// FUSENT_MOUNT_CASE_INSENSITIVE in flags, and the driver matches the names
+// it caches as missing the same way. The field used to be reserved, so
+// older modules leave it zero.
+typedef struct _FUSENT_MOUNT_SETUP {
+	FUSENT_RING_SETUP ring;
+	uint32_t version; // newest FUSENT_PROTO_ version the module understands
+	uint32_t flags; // FUSENT_MOUNT_*
+	uint32_t max_read; // largest read the module takes in one request
+	uint32_t max_write; // likewise for writes
+} FUSENT_MOUNT_SETUP;
+
+#define FUSENT_MOUNT_CASE_INSENSITIVE 0x00000001
+
 typedef struct _FUSENT_FILE_INFORMATION {
     LARGE_INTEGER CreationTime;
     LARGE_INTEGER LastAccessTime;
@@ -110,6 +209,7 @@ typedef struct _FUSENT_FILE_INFORMATION {
 typedef struct _FUSENT_RESP {
 	PIRP pirp;
 	PFILE_OBJECT fop;
+	uint64_t reqid; // from the FUSENT_REQ being answered
 	int error; // all high-level fuse operations return int
 	// negative is error (-errno); zero is OK
 	NTSTATUS status;
@@ -129,8 +229,32 @@ typedef struct _FUSENT_RESP {
 			uint32_t buflen;
 			// FILE_DIRECTORY_INFORMATION dirinfo[0]; defined as following the FUSENT_RESP header.
 		} dirctrl;
+		struct {
+			// Nonzero if the FUSENT_FILE_INFORMATION of the file just
+			// opened follows the FUSENT_RESP header, in which case the
+			// driver may answer queries on the file from it for valid_ms
+			// milliseconds, or until the file is written to. Older
+			// modules send neither.
+			uint32_t buflen;
+			uint32_t valid_ms;
+		} create;
+		struct {
+			// With a failed create of a name that wasn't there, nonzero
+			// if the driver may fail opens of the name for negative_ms
+			// milliseconds without asking, or until something is created
+			// in its directory. Older modules send zero.
+			uint32_t negative_ms;
+		} noent;
 		// potentially other kinds of responses here...
 	} params;
 } FUSENT_RESP;
 
+// Header before each response in an IRP_FUSE_MODULE_RESPONSE_BATCH buffer.
+// reclen covers the header, the response (with any data following it) and
+// the padding after it, and is a multiple of FUSENT_BATCH_ALIGN.
+typedef struct _FUSENT_RESP_HDR {
+	uint32_t reclen;
+	uint32_t reserved;
+} FUSENT_RESP_HDR;
+
 #endif /* NTPROTO_H */
@@ -0,0 +1,355 @@
+/*++
+
+Copyright (c) 2011 FUSE-NT Authors
+
+Module Name:
+
+    fusent_ring.h
+
+Abstract:
+
+    This module defines the shared-memory rings between the driver and a
+    module. The module side has its own copy of this file.
+
+--*/
+
+// Shared-memory rings between the driver and a module.
+//
+// A module that asks for them at mount time gets two rings in a region of its
+// own memory that the driver locks down and maps: a submission ring the
+// driver writes requests into, and a completion ring the module writes
+// responses into. Each ring has exactly one producer and one consumer at a
+// time (both sides serialize their own threads), and a side only needs to be
+// woken ("doorbell") when a ring it consumes goes from empty to non-empty.
+//
+// A ring is a power-of-two array of bytes holding variable-length records.
+// Every record starts with a FUSENT_RING_REC and is a multiple of
+// FUSENT_RING_ALIGN long, and a record never wraps around the end of the
+// array: if it doesn't fit in what's left, the producer fills the rest with a
+// pad record and starts over at the beginning. A FUSENT_RING_REC has the same
+// layout as FUSENT_REQ_HDR and FUSENT_RESP_HDR, so a run of records copied
+// out of a ring is a request or response batch as it stands.
+//
+// head and tail are free-running byte counters; only the consumer stores
+// head and only the producer stores tail. The producer fills in records
+// before it stores tail with release semantics, and the consumer is done
+// with records before it stores head with release semantics, so each side
+// reads the other's index with acquire semantics and can then trust (or
+// reuse) the bytes up to it.
+//
+// Wakeups work like Dekker's algorithm: after storing its index, each side
+// issues a full fence and then looks at the other side's index. A producer
+// that finds head where tail was before it published knows the consumer had
+// run dry (and may be about to sleep), so it rings the doorbell. A consumer
+// that finds tail past the head it just stored knows there is more to do,
+// so it must not sleep. One of the two always sees the other's store, so no
+// wakeup is lost, and doorbells that find the consumer awake are harmless.
+// A producer that runs out of room can ask to be woken the same way, by
+// setting FUSENT_RING_WAITING before it looks at head one last time; a
+// consumer looks for it after every release.
+//
+// The other side's memory can't be trusted: a view keeps its own copy of the
+// ring's geometry and of its own index, and everything read out of the
+// shared region is checked before it is used.
+//
+// Nothing in here depends on the kernel or on Windows. The includer supplies
+// uint32_t and uint8_t; the memory ordering comes from the GCC __atomic
+// builtins.
+
+#ifndef FUSENT_RING_H
+#define FUSENT_RING_H
+
+#include <stddef.h>
+#include <string.h>
+
+#define FUSENT_RING_MAGIC 0x474e5246 // "FRNG"
+#define FUSENT_RING_VERSION 1
+
+// Record alignment; the same as FUSENT_BATCH_ALIGN:
+#define FUSENT_RING_ALIGN 8
+
+// The indices live on cache lines of their own so that the producer and the
+// consumer don't keep stealing each other's line:
+#define FUSENT_RING_CACHELINE 64
+
+// Record flags (the rest are free for the records' own use):
+#define FUSENT_RING_REC_PAD 1 // filler (e.g. up to the end of the array); skip it
+
+// Ring flags:
+#define FUSENT_RING_WAITING 1 // the producer is out of room; wake it on release
+
+typedef struct _FUSENT_RING_REC {
+	uint32_t reclen; // header, body and padding
+	uint32_t flags;
+} FUSENT_RING_REC;
+
+typedef struct _FUSENT_RING {
+	uint32_t off; // of the record array, from the start of the region
+	uint32_t size; // of the record array; a power of two
+	uint8_t pad0[FUSENT_RING_CACHELINE - 2 * sizeof(uint32_t)];
+
+	volatile uint32_t head; // consumer's index
+	uint8_t pad1[FUSENT_RING_CACHELINE - sizeof(uint32_t)];
+
+	volatile uint32_t tail; // producer's index
+	volatile uint32_t flags; // producer's FUSENT_RING_ flags
+	uint8_t pad2[FUSENT_RING_CACHELINE - 2 * sizeof(uint32_t)];
+} FUSENT_RING;
+
+// The start of the shared region; the record arrays follow it.
+typedef struct _FUSENT_RING_REGION {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t length; // of the whole region
+	uint8_t pad[FUSENT_RING_CACHELINE - 3 * sizeof(uint32_t)];
+
+	FUSENT_RING sq; // submissions: driver -> module
+	FUSENT_RING cq; // completions: module -> driver
+} FUSENT_RING_REGION;
+
+// One side's handle on a ring.
+typedef struct _FUSENT_RING_VIEW {
+	FUSENT_RING *ring;
+	uint8_t *data;
+	uint32_t size;
+	uint32_t pos; // our own index: tail for a producer, head for a consumer
+	uint32_t published; // pos as of the last publish/release
+	uint32_t reclen; // of the record fusent_ring_peek() last returned, as checked
+} FUSENT_RING_VIEW;
+
+#define FUSENT_RING_LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define FUSENT_RING_STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define FUSENT_RING_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+static inline uint32_t fusent_ring_align(uint32_t len)
+{
+	return (len + FUSENT_RING_ALIGN - 1) & ~(uint32_t)(FUSENT_RING_ALIGN - 1);
+}
+
+// Lays out a region of `length' bytes at `base' with a submission ring of
+// sqsize bytes and a completion ring of cqsize bytes (both powers of two).
+//
+// Returns zero on success, negative if they don't fit.
+static inline int fusent_ring_region_init(void *base, uint32_t length,
+		uint32_t sqsize, uint32_t cqsize)
+{
+	FUSENT_RING_REGION *r = (FUSENT_RING_REGION *)base;
+	uint32_t off = sizeof(FUSENT_RING_REGION);
+
+	if ((sqsize & (sqsize - 1)) || (cqsize & (cqsize - 1)) ||
+			sqsize < 2 * FUSENT_RING_CACHELINE ||
+			cqsize < 2 * FUSENT_RING_CACHELINE ||
+			length < off || length - off < sqsize ||
+			length - off - sqsize < cqsize)
+		return -1;
+
+	memset(r, 0, sizeof(FUSENT_RING_REGION));
+	r->magic = FUSENT_RING_MAGIC;
+	r->version = FUSENT_RING_VERSION;
+	r->length = length;
+
+	r->sq.off = off;
+	r->sq.size = sqsize;
+	r->cq.off = off + sqsize;
+	r->cq.size = cqsize;
+
+	return 0;
+}
+
+// Attaches a view to one of the rings of a region of `length' bytes. The
+// ring's geometry and indices are checked and copied, so a view can be
+// attached to a region the other side is able to scribble on.
+//
+// Returns zero on success, negative if the ring is malformed.
+static inline int fusent_ring_attach(FUSENT_RING_VIEW *v, void *base,
+		uint32_t length, FUSENT_RING *ring, int producer)
+{
+	uint32_t off = ring->off, size = ring->size;
+	uint32_t head, tail;
+
+	if (!size || (size & (size - 1)) || size < 2 * FUSENT_RING_CACHELINE ||
+			off < sizeof(FUSENT_RING_REGION) || off > length ||
+			length - off < size || off % FUSENT_RING_ALIGN)
+		return -1;
+
+	head = FUSENT_RING_LOAD_ACQUIRE(&ring->head);
+	tail = FUSENT_RING_LOAD_ACQUIRE(&ring->tail);
+	if (tail - head > size)
+		return -1;
+
+	v->ring = ring;
+	v->data = (uint8_t *)base + off;
+	v->size = size;
+	v->pos = producer ? tail : head;
+	v->published = v->pos;
+	v->reclen = 0;
+
+	return 0;
+}
+
+//
+// Producer side
+//
+
+// Reserves room for a record of reclen bytes (FUSENT_RING_REC included; a
+// multiple of FUSENT_RING_ALIGN) and fills in its header. The caller writes
+// the body after the header, and can reserve more records before publishing
+// them all at once. A reserved record the caller can't fill after all can
+// be published as a pad by setting FUSENT_RING_REC_PAD in its flags.
+//
+// Returns the record, or NULL if the ring is too full (or the consumer has
+// corrupted its index).
+static inline FUSENT_RING_REC *fusent_ring_reserve(FUSENT_RING_VIEW *v,
+		uint32_t reclen)
+{
+	uint32_t head = FUSENT_RING_LOAD_ACQUIRE(&v->ring->head);
+	uint32_t used = v->pos - head;
+	uint32_t at = v->pos & (v->size - 1);
+	uint32_t toend = v->size - at;
+	uint32_t need = reclen;
+	FUSENT_RING_REC *rec;
+
+	if (reclen < sizeof(FUSENT_RING_REC) || reclen % FUSENT_RING_ALIGN ||
+			reclen > v->size / 2 || used > v->size)
+		return NULL;
+
+	// Records don't wrap; pad out to the end first:
+	if (toend < reclen)
+		need += toend;
+
+	if (v->size - used < need)
+		return NULL;
+
+	if (toend < reclen) {
+		rec = (FUSENT_RING_REC *)(v->data + at);
+		rec->reclen = toend;
+		rec->flags = FUSENT_RING_REC_PAD;
+		v->pos += toend;
+		at = 0;
+	}
+
+	rec = (FUSENT_RING_REC *)(v->data + at);
+	rec->reclen = reclen;
+	rec->flags = 0;
+	v->pos += reclen;
+
+	return rec;
+}
+
+// Makes every record reserved so far visible to the consumer.
+//
+// Returns nonzero if the consumer had run out of records before these
+// arrived, in which case the caller has to ring its doorbell.
+static inline int fusent_ring_publish(FUSENT_RING_VIEW *v)
+{
+	uint32_t before = v->published;
+	uint32_t head;
+
+	if (v->pos == before)
+		return 0;
+
+	FUSENT_RING_STORE_RELEASE(&v->ring->tail, v->pos);
+	v->published = v->pos;
+
+	FUSENT_RING_FENCE();
+	head = FUSENT_RING_LOAD_ACQUIRE(&v->ring->head);
+
+	return head == before;
+}
+
+// Says whether the producer is waiting for the consumer to make room. A
+// producer that can't reserve a record sets this and then tries once more
+// before going to sleep; the consumer will see it on its next release.
+static inline void fusent_ring_set_waiting(FUSENT_RING_VIEW *v, int waiting)
+{
+	__atomic_store_n(&v->ring->flags, waiting ? FUSENT_RING_WAITING : 0,
+			__ATOMIC_RELAXED);
+	FUSENT_RING_FENCE();
+}
+
+//
+// Consumer side
+//
+
+// Returns the next record, skipping pads, or NULL if there are none. *bad is
+// set if the producer has corrupted the ring, in which case nothing more can
+// be read from it. The record stays in the ring until it is consumed.
+//
+// The record's length as checked is left in v->reclen; use that rather than
+// reading rec->reclen again, which the producer may have changed since.
+static inline FUSENT_RING_REC *fusent_ring_peek(FUSENT_RING_VIEW *v, int *bad)
+{
+	uint32_t tail = FUSENT_RING_LOAD_ACQUIRE(&v->ring->tail);
+
+	*bad = 0;
+
+	for (;;) {
+		uint32_t avail = tail - v->pos;
+		uint32_t at = v->pos & (v->size - 1);
+		FUSENT_RING_REC *rec;
+		uint32_t reclen;
+
+		if (!avail)
+			return NULL;
+
+		rec = (FUSENT_RING_REC *)(v->data + at);
+		reclen = rec->reclen;
+
+		if (avail > v->size || avail < sizeof(FUSENT_RING_REC) ||
+				reclen < sizeof(FUSENT_RING_REC) ||
+				reclen % FUSENT_RING_ALIGN || reclen > avail ||
+				reclen > v->size - at) {
+			*bad = 1;
+			return NULL;
+		}
+
+		if (!(rec->flags & FUSENT_RING_REC_PAD)) {
+			if (reclen > v->size / 2) {
+				*bad = 1;
+				return NULL;
+			}
+
+			v->reclen = reclen;
+			return rec;
+		}
+
+		v->pos += reclen;
+	}
+}
+
+// Moves past the record fusent_ring_peek() returned. Its space isn't handed
+// back to the producer until fusent_ring_release().
+static inline void fusent_ring_consume(FUSENT_RING_VIEW *v)
+{
+	v->pos += v->reclen;
+	v->reclen = 0;
+}
+
+// Hands the space of every record consumed so far back to the producer.
+//
+// Returns nonzero if more records have been published since, in which case
+// the caller must not go to sleep.
+static inline int fusent_ring_release(FUSENT_RING_VIEW *v)
+{
+	uint32_t tail;
+
+	if (v->pos != v->published) {
+		FUSENT_RING_STORE_RELEASE(&v->ring->head, v->pos);
+		v->published = v->pos;
+	}
+
+	FUSENT_RING_FENCE();
+	tail = FUSENT_RING_LOAD_ACQUIRE(&v->ring->tail);
+
+	return tail != v->pos;
+}
+
+// Returns nonzero if the producer has asked to be woken when there is room
+// (see fusent_ring_set_waiting()). Only meaningful after a release.
+static inline int fusent_ring_producer_waiting(FUSENT_RING_VIEW *v)
+{
+	return (__atomic_load_n(&v->ring->flags, __ATOMIC_RELAXED) &
+			FUSENT_RING_WAITING) != 0;
+}
+
+#endif /* FUSENT_RING_H */
@@ -1,10 +1,8 @@
 #ifndef _FUSEPROCS_
 #define _FUSEPROCS_
 
-typedef struct _hashmap hashmap;
-
-extern hashmap ModuleMap;
-extern hashmap UserspaceMap;
+extern FUSE_MODULE_MAP ModuleMap;
+extern FUSE_FILE_CONTEXT_MAP FileContextMap;
 
 //
 //  Uncomment FUSE_DEBUG0 to get detailed driver structure interaction output,
@@ -104,6 +102,150 @@ FAST_IO_ACQUIRE_FOR_CCFLUSH FuseAcquireForCcFlush;
 
 FAST_IO_RELEASE_FOR_CCFLUSH FuseReleaseForCcFlush;
 
+//
+//  Module lookup and reference counting, implemented in FuseIo.c
+//
+
+PMODULE_STRUCT
+FuseLookupModule (
+    IN WCHAR* ModuleName
+    );
+
+VOID
+FuseReferenceModule (
+    IN PMODULE_STRUCT ModuleStruct
+    );
+
+VOID
+FuseDereferenceModule (
+    IN PMODULE_STRUCT ModuleStruct
+    );
+
+VOID
+FuseRundownModule (
+    IN PMODULE_STRUCT ModuleStruct
+    );
+
+VOID
+FuseCompleteCancelledIrp (
+    IN PIRP Irp
+    );
+
+//
+//  Passing requests to modules and taking in their responses, implemented
+//  in FuseIo.c
+//
+
+NTSTATUS
+FuseAddUserspaceIrp (
+    IN PIRP Irp,
+    IN PIO_STACK_LOCATION IrpSp
+    );
+
+ULONG
+FuseRequestLength (
+    IN PMODULE_STRUCT ModuleStruct,
+    IN PIRP UserspaceIrp,
+    IN BOOLEAN Batched
+    );
+
+NTSTATUS
+FusePackRequest (
+    IN PMODULE_STRUCT ModuleStruct,
+    IN PIRP UserspaceIrp,
+    OUT PCHAR Buffer,
+    IN ULONG BufferLength,
+    IN BOOLEAN Batched,
+    OUT PULONG Used
+    );
+
+NTSTATUS
+FuseCompleteResponse (
+    IN PMODULE_STRUCT ModuleStruct,
+    IN FUSENT_RESP* FuseNtResp,
+    IN ULONG ResponseLength
+    );
+
+//
+//  Shared-memory rings, implemented in FuseRing.c
+//
+
+NTSTATUS
+FuseSetupRing (
+    IN PMODULE_STRUCT ModuleStruct,
+    IN PIRP Irp,
+    IN FUSENT_RING_SETUP* Setup
+    );
+
+VOID
+FuseTeardownRing (
+    IN PMODULE_STRUCT ModuleStruct
+    );
+
+VOID
+FuseRingSubmit (
+    IN PMODULE_STRUCT ModuleStruct,
+    IN PIRP Irp
+    );
+
+NTSTATUS
+FuseRingDoorbell (
+    IN PMODULE_STRUCT ModuleStruct
+    );
+
+//
+//  Splitting large reads and writes, implemented in FuseSplit.c
+//
+
+BOOLEAN
+FuseSplitIrp (
+    IN PDEVICE_OBJECT DeviceObject,
+    IN PIRP Irp,
+    IN PIO_STACK_LOCATION IrpSp
+    );
+
+//
+//  File information kept from the create, implemented in FuseQuery.c. A file
+//  whose module reported its information along with the create (see
+//  FUSENT_RESP) gets a FUSE_FILE_CONTEXT in FileContextMap, freed when the
+//  file is closed, from which queries on the file are answered without going
+//  to the module. The information is good until InfoExpires, an interrupt
+//  time, or until the file is written to. Lock protects it.
+//
+//  It isn't hung off FsContext: FsRtl and filters take a non-NULL FsContext
+//  to start with an FSRTL_ADVANCED_FCB_HEADER, which this driver doesn't keep
+//
+
+typedef struct _FUSE_FILE_CONTEXT {
+    FAST_MUTEX Lock;
+    BOOLEAN InfoValid;
+    ULONGLONG InfoExpires;
+    FUSENT_FILE_INFORMATION Info;
+} FUSE_FILE_CONTEXT, *PFUSE_FILE_CONTEXT;
+
+VOID
+FuseStashFileInformation (
+    IN PFILE_OBJECT FileObject,
+    IN FUSENT_FILE_INFORMATION* ModuleFileInformation,
+    IN ULONG ValidMs
+    );
+
+BOOLEAN
+FuseLookupFileInformation (
+    IN PFILE_OBJECT FileObject,
+    OUT FUSENT_FILE_INFORMATION* FileInformation
+    );
+
+VOID
+FuseInvalidateFileInformation (
+    IN PFILE_OBJECT FileObject
+    );
+
+VOID
+FuseFreeFileContext (
+    IN PFILE_OBJECT FileObject
+    );
+
 //
 //  Utility functions
 //
@@ -143,6 +285,14 @@ FuseQueryStandardInfo (
     IN OUT PLONG Length
     );
 
+NTSTATUS
+FuseQueryNetworkOpenInfo (
+    IN OUT PFILE_NETWORK_OPEN_INFORMATION Buffer,
+    IN FUSENT_FILE_INFORMATION* ModuleFileInformation,
+    IN ULONG ModuleFileInformationLength,
+    IN OUT PLONG Length
+    );
+
 NTSTATUS
 FuseQueryNameInfo (
     IN PIO_STACK_LOCATION IrpSp,
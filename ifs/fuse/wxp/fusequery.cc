@@ -161,7 +161,7 @@ FuseCopyDirectoryControl (
 
             memcpy(NamesInfo->FileName, FileName, FileNameLength);
             NamesInfo->FileNameLength = FileNameLength;
-            NamesInfo->FileIndex = str_hash_fn(FileName);
+            NamesInfo->FileIndex = FuseHashName(FileName, FileNameLength / sizeof(WCHAR));
             NamesInfo->NextEntryOffset = NamesInformationLength;
 
             LastNamesInfo = NamesInfo;
@@ -237,6 +237,11 @@ FuseCopyInformation (
         FuseQueryNameInfo(IrpSp, &AllInfo->NameInformation, ModuleFileInformation, ModuleFileInformationLength, &Length);
         break;
 
+    case FileNetworkOpenInformation:
+
+        FuseQueryNetworkOpenInfo((PFILE_NETWORK_OPEN_INFORMATION) AllInfo, ModuleFileInformation, ModuleFileInformationLength, &Length);
+        break;
+
     default:
 
         Status = STATUS_INVALID_PARAMETER;
@@ -341,6 +346,46 @@ FuseQueryStandardInfo (
     return Status;
 }
 
+NTSTATUS
+FuseQueryNetworkOpenInfo (
+    IN OUT PFILE_NETWORK_OPEN_INFORMATION Buffer,
+    IN FUSENT_FILE_INFORMATION* ModuleFileInformation,
+    IN ULONG ModuleFileInformationLength,
+    IN OUT PLONG Length
+    )
+{
+    NTSTATUS Status = STATUS_SUCCESS;
+    LONG InformationLength = sizeof(FILE_NETWORK_OPEN_INFORMATION);
+
+#ifdef FUSE_DEBUG1
+    DbgPrint("FuseQueryNetworkOpenInfo\n");
+#endif
+
+    //
+    //  First check if there is enough space to write the information to the buffer
+    //
+
+    if(*Length < InformationLength) {
+
+        Status = STATUS_BUFFER_OVERFLOW;
+    } else {
+
+        RtlZeroMemory(Buffer, InformationLength);
+
+        Buffer->CreationTime = ModuleFileInformation->CreationTime;
+        Buffer->LastAccessTime = ModuleFileInformation->LastAccessTime;
+        Buffer->LastWriteTime = ModuleFileInformation->LastWriteTime;
+        Buffer->ChangeTime = ModuleFileInformation->ChangeTime;
+        Buffer->AllocationSize = ModuleFileInformation->AllocationSize;
+        Buffer->EndOfFile = ModuleFileInformation->EndOfFile;
+        Buffer->FileAttributes = ModuleFileInformation->FileAttributes;
+
+        *Length -= InformationLength;
+    }
+
+    return Status;
+}
+
 NTSTATUS
 FuseQueryNameInfo (
     IN PIO_STACK_LOCATION IrpSp,
@@ -379,6 +424,128 @@ FuseQueryNameInfo (
     return Status;
 }
 
+//
+//  Open files' contexts by file object. The map does its own locking and
+//  grows as files are opened (see hashtable.h)
+//
+FUSE_FILE_CONTEXT_MAP FileContextMap;
+
+VOID
+FuseStashFileInformation (
+    IN PFILE_OBJECT FileObject,
+    IN FUSENT_FILE_INFORMATION* ModuleFileInformation,
+    IN ULONG ValidMs
+    )
+//
+//  Keeps the information the module reported along with the create of the
+//  given file for ValidMs milliseconds. The file has only just been opened,
+//  so nothing else can be looking for its context yet
+//
+{
+    PFUSE_FILE_CONTEXT Context;
+
+    if(!ValidMs) {
+        return;
+    }
+
+    Context = (PFUSE_FILE_CONTEXT) ExAllocatePoolWithTag(NonPagedPool, sizeof(FUSE_FILE_CONTEXT), M_FUSE);
+
+    if(!Context) {
+        return;
+    }
+
+    ExInitializeFastMutex(&Context->Lock);
+
+    Context->Info = *ModuleFileInformation;
+    Context->InfoExpires = KeQueryInterruptTime() + (ULONGLONG) ValidMs * 10000;
+    Context->InfoValid = TRUE;
+
+    if(!FileContextMap.Insert(FileObject, Context)) {
+        ExFreePool(Context);
+    }
+}
+
+static PFUSE_FILE_CONTEXT
+FuseFindFileContext (
+    IN PFILE_OBJECT FileObject
+    )
+//
+//  Returns the context kept for the given file, if any. It stays put until
+//  the file is closed, so the caller may use it without holding the table
+//
+{
+    PFUSE_FILE_CONTEXT Context;
+
+    if(!FileContextMap.Lookup(FileObject, &Context, NULL)) {
+        return NULL;
+    }
+
+    return Context;
+}
+
+BOOLEAN
+FuseLookupFileInformation (
+    IN PFILE_OBJECT FileObject,
+    OUT FUSENT_FILE_INFORMATION* FileInformation
+    )
+//
+//  Copies out the information kept for the given file, if there is any and it
+//  hasn't expired
+//
+{
+    PFUSE_FILE_CONTEXT Context = FuseFindFileContext(FileObject);
+
+    if(!Context) {
+        return FALSE;
+    }
+
+    ScopedExLock Lock(&Context->Lock);
+
+    if(Context->InfoValid && KeQueryInterruptTime() >= Context->InfoExpires) {
+        Context->InfoValid = FALSE;
+    }
+
+    if(!Context->InfoValid) {
+        return FALSE;
+    }
+
+    *FileInformation = Context->Info;
+
+    return TRUE;
+}
+
+VOID
+FuseInvalidateFileInformation (
+    IN PFILE_OBJECT FileObject
+    )
+//
+//  Forgets the information kept for the given file, which is about to change
+//
+{
+    PFUSE_FILE_CONTEXT Context = FuseFindFileContext(FileObject);
+
+    if(Context) {
+        ScopedExLock Lock(&Context->Lock);
+
+        Context->InfoValid = FALSE;
+    }
+}
+
+VOID
+FuseFreeFileContext (
+    IN PFILE_OBJECT FileObject
+    )
+//
+//  Drops the context kept for the given file, which is being closed
+//
+{
+    PFUSE_FILE_CONTEXT Context;
+
+    if(FileContextMap.Remove(FileObject, &Context)) {
+        ExFreePool(Context);
+    }
+}
+
 NTSTATUS
 FuseCopyVolumeInformation (
     IN OUT PIRP Irp
@@ -0,0 +1,373 @@
+#include "fuse_includes.h"
+
+//
+//  A module that mounts with shared-memory rings (see FUSENT_RING_SETUP and
+//  fusent_ring.h) gets its work without posting IRPs for it: userspace IRPs
+//  are written straight into the submission ring, and the module's event is
+//  only set when the ring goes from empty to non-empty. The module writes its
+//  responses into the completion ring and only calls down, with
+//  IRP_FUSE_MODULE_RING_DOORBELL, when that ring goes from empty to non-empty
+//  or when it has made room the driver was waiting for
+//
+
+//
+//  The largest region a module may have locked down for its rings
+//
+
+#define FUSE_RING_MAX_LENGTH (64 * 1024 * 1024)
+
+static VOID
+FuseFreeRing (
+    IN PFUSE_RING Ring
+    )
+//
+//  Frees a ring and whatever it holds (see FuseSetupRing)
+//
+{
+    if(Ring->Staging) {
+        ExFreePool(Ring->Staging);
+    }
+
+    if(Ring->Mdl) {
+        MmUnlockPages(Ring->Mdl);
+        IoFreeMdl(Ring->Mdl);
+    }
+
+    if(Ring->SqEvent) {
+        ObDereferenceObject(Ring->SqEvent);
+    }
+
+    ExFreePool(Ring);
+}
+
+NTSTATUS
+FuseSetupRing (
+    IN PMODULE_STRUCT ModuleStruct,
+    IN PIRP Irp,
+    IN FUSENT_RING_SETUP* Setup
+    )
+//
+//  Sets up the rings a module asked for in its IRP_FUSE_MOUNT, which is
+//  METHOD_NEITHER and so still in the module's context: the region is locked
+//  down and mapped, and the event referenced. Setup has already been copied
+//  in. If this fails, the module is left without rings
+//
+{
+    FUSENT_RING_REGION* Region;
+    PFUSE_RING Ring;
+    NTSTATUS Status;
+
+    if(Setup->length < sizeof(FUSENT_RING_REGION) || Setup->length > FUSE_RING_MAX_LENGTH) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Ring = (PFUSE_RING) ExAllocatePoolWithTag(NonPagedPool, sizeof(FUSE_RING), M_FUSE);
+
+    if(!Ring) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(Ring, sizeof(FUSE_RING));
+    ExInitializeFastMutex(&Ring->SqLock);
+    ExInitializeFastMutex(&Ring->CqLock);
+    InitializeListHead(&Ring->Backlog);
+
+    Status = ObReferenceObjectByHandle(Setup->sqevent, EVENT_MODIFY_STATE, *ExEventObjectType,
+        Irp->RequestorMode, (PVOID*) &Ring->SqEvent, NULL);
+
+    if(!NT_SUCCESS(Status)) {
+        Ring->SqEvent = NULL;
+        FuseFreeRing(Ring);
+
+        return Status;
+    }
+
+    //
+    //  Lock the region down for as long as the module is mounted
+    //
+
+    Ring->Mdl = IoAllocateMdl(Setup->region, Setup->length, FALSE, FALSE, NULL);
+
+    if(!Ring->Mdl) {
+        FuseFreeRing(Ring);
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    try {
+        MmProbeAndLockPages(Ring->Mdl, Irp->RequestorMode, IoWriteAccess);
+    } catch (...) {
+        IoFreeMdl(Ring->Mdl);
+        Ring->Mdl = NULL;
+        FuseFreeRing(Ring);
+
+        return STATUS_INVALID_USER_BUFFER;
+    }
+
+    //
+    //  The module can still write to the region, so the views are checked
+    //  and keep copies of everything they depend on
+    //
+
+    Region = (FUSENT_RING_REGION*) MmGetSystemAddressForMdlSafe(Ring->Mdl, NormalPagePriority);
+
+    if(!Region || Region->magic != FUSENT_RING_MAGIC || Region->version != FUSENT_RING_VERSION ||
+        fusent_ring_attach(&Ring->Sq, Region, Setup->length, &Region->sq, 1) ||
+        fusent_ring_attach(&Ring->Cq, Region, Setup->length, &Region->cq, 0)) {
+
+        DbgPrint("Module %S supplied a bad ring region\n", ModuleStruct->ModuleName);
+
+        FuseFreeRing(Ring);
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    //
+    //  No response in the completion ring can be larger than half of it
+    //
+
+    Ring->Staging = (PCHAR) ExAllocatePoolWithTag(NonPagedPool, Ring->Cq.size / 2, M_FUSE);
+
+    if(!Ring->Staging) {
+        FuseFreeRing(Ring);
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    ModuleStruct->Ring = Ring;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+FuseTeardownRing (
+    IN PMODULE_STRUCT ModuleStruct
+    )
+//
+//  Cancels the backlog and frees the rings. Called by the rundown, once nothing
+//  else can be using them; IRPs that were in the submission ring are still in
+//  the table of outstanding IRPs, which the rundown has already drained
+//
+{
+    PFUSE_RING Ring = ModuleStruct->Ring;
+
+    ModuleStruct->Ring = NULL;
+
+    while(!IsListEmpty(&Ring->Backlog)) {
+        PLIST_ENTRY Entry = RemoveHeadList(&Ring->Backlog);
+
+        FuseCompleteCancelledIrp(CONTAINING_RECORD(Entry, IRP, Tail.Overlay.ListEntry));
+    }
+
+    FuseFreeRing(Ring);
+}
+
+static BOOLEAN
+FuseRingPack (
+    IN PMODULE_STRUCT ModuleStruct,
+    IN PFUSE_RING Ring,
+    IN PIRP Irp
+    )
+//
+//  Writes a userspace request into the submission ring the way FusePackRequest
+//  writes one into a batch. The caller holds SqLock, and publishes
+//
+//  Returns FALSE if there is no room for it yet. Otherwise the request is in the
+//  ring, or it never can be and the IRP has been failed
+//
+{
+    ULONG RecordSize = FuseRequestLength(ModuleStruct, Irp, TRUE);
+    FUSENT_RING_REC* Record;
+    NTSTATUS Status;
+    ULONG Used;
+
+    if(RecordSize > Ring->Sq.size / 2) {
+        DbgPrint("Request of %d bytes does not fit in the submission ring of module %S\n",
+            RecordSize, ModuleStruct->ModuleName);
+
+        Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+        return TRUE;
+    }
+
+    Record = fusent_ring_reserve(&Ring->Sq, RecordSize);
+
+    if(!Record) {
+        return FALSE;
+    }
+
+    Status = FusePackRequest(ModuleStruct, Irp, (PCHAR) Record, RecordSize, TRUE, &Used);
+
+    if(!NT_SUCCESS(Status)) {
+
+        //
+        //  The room is taken, so leave a pad there for the module to skip
+        //
+
+        Record->reclen = RecordSize;
+        Record->flags = FUSENT_RING_REC_PAD;
+
+        Irp->IoStatus.Status = Status;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    }
+
+    return TRUE;
+}
+
+static VOID
+FuseRingDrainBacklog (
+    IN PMODULE_STRUCT ModuleStruct,
+    IN PFUSE_RING Ring
+    )
+//
+//  Moves as much of the backlog into the submission ring as fits, in order. If
+//  some is left over, the module is asked to ring the doorbell once it has made
+//  room. The caller holds SqLock, and publishes
+//
+{
+    BOOLEAN Retried = FALSE;
+
+    while(!IsListEmpty(&Ring->Backlog)) {
+        PLIST_ENTRY Entry = RemoveHeadList(&Ring->Backlog);
+        PIRP Irp = CONTAINING_RECORD(Entry, IRP, Tail.Overlay.ListEntry);
+
+        if(Irp->Cancel) {
+            FuseCompleteCancelledIrp(Irp);
+            continue;
+        }
+
+        if(FuseRingPack(ModuleStruct, Ring, Irp)) {
+            continue;
+        }
+
+        InsertHeadList(&Ring->Backlog, Entry);
+
+        //
+        //  Out of room. Ask to be woken and then look once more, in case the
+        //  module made room before it could see the request (see fusent_ring.h)
+        //
+
+        if(Retried) {
+            return;
+        }
+
+        fusent_ring_set_waiting(&Ring->Sq, 1);
+        Ring->SqWaiting = TRUE;
+        Retried = TRUE;
+    }
+
+    if(Ring->SqWaiting) {
+        fusent_ring_set_waiting(&Ring->Sq, 0);
+        Ring->SqWaiting = FALSE;
+    }
+}
+
+VOID
+FuseRingSubmit (
+    IN PMODULE_STRUCT ModuleStruct,
+    IN PIRP Irp
+    )
+//
+//  Hands a userspace IRP to the module through its submission ring, behind any
+//  backlog, and wakes the module if the ring was empty. The IRP has been marked
+//  pending (and may already have been completed), so the caller should return
+//  STATUS_PENDING
+//
+{
+    PFUSE_RING Ring = ModuleStruct->Ring;
+    BOOLEAN Wake;
+
+    FusePrePostIrp(Irp);
+    IoMarkIrpPending(Irp);
+
+    {
+        ScopedExLock Lock(&Ring->SqLock);
+
+        InsertTailList(&Ring->Backlog, &Irp->Tail.Overlay.ListEntry);
+        FuseRingDrainBacklog(ModuleStruct, Ring);
+
+        Wake = fusent_ring_publish(&Ring->Sq) ? TRUE : FALSE;
+    }
+
+    if(Wake) {
+        KeSetEvent(Ring->SqEvent, IO_NO_INCREMENT, FALSE);
+    }
+}
+
+NTSTATUS
+FuseRingDoorbell (
+    IN PMODULE_STRUCT ModuleStruct
+    )
+//
+//  Answers the module's IRP_FUSE_MODULE_RING_DOORBELL: completes the userspace IRP
+//  for every response in the completion ring, and then moves whatever of the
+//  backlog now fits into the submission ring
+//
+{
+    PFUSE_RING Ring = ModuleStruct->Ring;
+    NTSTATUS Status = STATUS_SUCCESS;
+    BOOLEAN Wake;
+
+    {
+        ScopedExLock CqLock(&Ring->CqLock);
+        int Bad = 0;
+
+        //
+        //  Keep going until a release finds that nothing more was published
+        //  meanwhile; the module won't ring again for those
+        //
+
+        do {
+            ScopedExLock Lock(&ModuleStruct->ModuleLock);
+            FUSENT_RING_REC* Record;
+
+            while((Record = fusent_ring_peek(&Ring->Cq, &Bad))) {
+                ULONG Length = Ring->Cq.reclen - sizeof(FUSENT_RING_REC);
+
+                if(Length < sizeof(FUSENT_RESP)) {
+                    DbgPrint("Completion ring of module %S has a record of size %d\n",
+                        ModuleStruct->ModuleName, Ring->Cq.reclen);
+
+                    Status = STATUS_INVALID_BUFFER_SIZE;
+                } else {
+                    NTSTATUS ResponseStatus;
+
+                    //
+                    //  Copy the response out before looking at it (see FUSE_RING)
+                    //
+
+                    memcpy(Ring->Staging, Record + 1, Length);
+
+                    ResponseStatus = FuseCompleteResponse(ModuleStruct, (FUSENT_RESP*) Ring->Staging, Length);
+
+                    if(!NT_SUCCESS(ResponseStatus)) {
+                        Status = ResponseStatus;
+                    }
+                }
+
+                fusent_ring_consume(&Ring->Cq);
+            }
+        } while(!Bad && fusent_ring_release(&Ring->Cq));
+
+        if(Bad) {
+            DbgPrint("Completion ring of module %S is corrupt\n", ModuleStruct->ModuleName);
+
+            Status = STATUS_INVALID_USER_BUFFER;
+        }
+    }
+
+    {
+        ScopedExLock Lock(&Ring->SqLock);
+
+        FuseRingDrainBacklog(ModuleStruct, Ring);
+
+        Wake = fusent_ring_publish(&Ring->Sq) ? TRUE : FALSE;
+    }
+
+    if(Wake) {
+        KeSetEvent(Ring->SqEvent, IO_NO_INCREMENT, FALSE);
+    }
+
+    return Status;
+}
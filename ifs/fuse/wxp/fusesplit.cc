@@ -0,0 +1,261 @@
+#include "fuse_includes.h"
+
+//
+//  A read or write larger than its module takes in one request (see
+//  FUSENT_MOUNT_SETUP) goes to the module in pieces. Each piece is an
+//  associated IRP of the original, with a partial MDL over its part of the
+//  original's buffer, and goes to the module like any other userspace IRP, so
+//  that several of the module's workers can be on the one request at once.
+//  The I/O manager completes the original once the last piece is completed;
+//  on the way, FuseSplitPieceComplete folds each piece's outcome into the
+//  request's FUSE_SPLIT
+//
+//  Read and write parameters are laid out alike, so the code below only ever
+//  looks at Parameters.Read
+//
+
+static ULONG
+FuseSplitLimit (
+    IN PIO_STACK_LOCATION IrpSp
+    )
+//
+//  Returns the size of the pieces to split the given read or write into, or 0 if
+//  it goes to the module whole
+//
+{
+    PMODULE_STRUCT ModuleStruct = (PMODULE_STRUCT) IrpSp->FileObject->FsContext2;
+    ULONG Limit;
+
+    if(!ModuleStruct) {
+        return 0;
+    }
+
+    Limit = IrpSp->MajorFunction == IRP_MJ_READ ? ModuleStruct->MaxRead : ModuleStruct->MaxWrite;
+
+    if(!Limit || IrpSp->Parameters.Read.Length <= Limit || FlagOn(IrpSp->MinorFunction, IRP_MN_MDL)) {
+        return 0;
+    }
+
+    //
+    //  The pieces of a request at a stand-in offset (the end of the file, say)
+    //  wouldn't know where they go
+    //
+
+    if(IrpSp->Parameters.Read.ByteOffset.QuadPart < 0) {
+        return 0;
+    }
+
+    return Limit;
+}
+
+static VOID
+FuseSplitFinish (
+    IN PFUSE_SPLIT Split
+    )
+//
+//  Fills in the original IRP's IoStatus once all of its pieces are done, and frees
+//  the split. The I/O manager completes the IRP right after
+//
+{
+    PIRP MasterIrp = Split->MasterIrp;
+    ULONG Done = (ULONG) Split->Done;
+
+    if(!NT_SUCCESS(Split->Status)) {
+        MasterIrp->IoStatus.Status = Split->Status;
+        MasterIrp->IoStatus.Information = 0;
+    } else if(Done == 0 && Split->EndOfFile) {
+        MasterIrp->IoStatus.Status = STATUS_END_OF_FILE;
+        MasterIrp->IoStatus.Information = 0;
+    } else {
+        MasterIrp->IoStatus.Status = STATUS_SUCCESS;
+        MasterIrp->IoStatus.Information = Done;
+
+        FuseAdvanceFilePosition(MasterIrp, IoGetCurrentIrpStackLocation(MasterIrp), Done);
+    }
+
+    ExFreePool(Split);
+}
+
+static NTSTATUS
+FuseSplitPieceComplete (
+    IN PDEVICE_OBJECT DeviceObject,
+    IN PIRP Irp,
+    IN PVOID Context
+    )
+//
+//  Completion routine for a piece of a split request. Our own stack location in the
+//  piece, which is current again by now, says which part of the original it covers
+//  (see FuseSplitIrp)
+//
+{
+    PFUSE_SPLIT Split = (PFUSE_SPLIT) Context;
+    PIO_STACK_LOCATION PieceSp = IoGetCurrentIrpStackLocation(Irp);
+    ULONG Start = (ULONG) (PieceSp->Parameters.Read.ByteOffset.QuadPart - Split->ByteOffset);
+    ULONG Length = PieceSp->Parameters.Read.Length;
+    ULONG Got = 0;
+
+    if(NT_SUCCESS(Irp->IoStatus.Status)) {
+        Got = Irp->IoStatus.Information < Length ? (ULONG) Irp->IoStatus.Information : Length;
+    } else if(Irp->IoStatus.Status == STATUS_END_OF_FILE) {
+        InterlockedExchange(&Split->EndOfFile, 1);
+    } else {
+        InterlockedCompareExchange(&Split->Status, Irp->IoStatus.Status, STATUS_SUCCESS);
+    }
+
+    //
+    //  Whatever the pieces past one that came up short did is lost to the caller
+    //
+
+    if(Got < Length) {
+        LONG Done = Split->Done;
+
+        while((ULONG) Done > Start + Got) {
+            LONG Seen = InterlockedCompareExchange(&Split->Done, (LONG) (Start + Got), Done);
+
+            if(Seen == Done) {
+                break;
+            }
+
+            Done = Seen;
+        }
+    }
+
+    if(InterlockedDecrement(&Split->Pieces) == 0) {
+        FuseSplitFinish(Split);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+BOOLEAN
+FuseSplitIrp (
+    IN PDEVICE_OBJECT DeviceObject,
+    IN PIRP Irp,
+    IN PIO_STACK_LOCATION IrpSp
+    )
+//
+//  Sends the given read or write to its module in pieces if it is larger than the
+//  module takes in one request. Returns TRUE if it did, in which case the IRP has been
+//  marked pending (and may already have been completed) and the caller should return
+//  STATUS_PENDING. Returns FALSE if the IRP should go to the module whole, which is
+//  also what happens if there isn't the memory to split it
+//
+{
+    ULONG Limit = FuseSplitLimit(IrpSp);
+    ULONG Length = IrpSp->Parameters.Read.Length;
+    PFUSE_SPLIT Split;
+    LIST_ENTRY Pieces;
+    LONG Count = 0;
+    ULONG Offset;
+    PCHAR Va;
+
+    if(!Limit) {
+        return FALSE;
+    }
+
+    //
+    //  The pieces' MDLs are carved out of the original's, so lock its buffer down
+    //  now rather than when it is queued
+    //
+
+    FusePrePostIrp(Irp);
+
+    if(!Irp->MdlAddress) {
+        return FALSE;
+    }
+
+    Split = (PFUSE_SPLIT) ExAllocatePoolWithTag(NonPagedPool, sizeof(FUSE_SPLIT), M_FUSE);
+
+    if(!Split) {
+        return FALSE;
+    }
+
+    Split->MasterIrp = Irp;
+    Split->ByteOffset = IrpSp->Parameters.Read.ByteOffset.QuadPart;
+    Split->Done = (LONG) Length;
+    Split->Status = STATUS_SUCCESS;
+    Split->EndOfFile = 0;
+
+    InitializeListHead(&Pieces);
+    Va = (PCHAR) MmGetMdlVirtualAddress(Irp->MdlAddress);
+
+    for(Offset = 0; Offset < Length; Offset += Limit) {
+        ULONG PieceLength = min(Length - Offset, Limit);
+        PIRP Piece = IoMakeAssociatedIrp(Irp, 2);
+        PIO_STACK_LOCATION PieceSp;
+
+        if(!Piece) {
+            break;
+        }
+
+        if(!IoAllocateMdl(Va + Offset, PieceLength, FALSE, FALSE, Piece)) {
+            IoFreeIrp(Piece);
+            break;
+        }
+
+        IoBuildPartialMdl(Irp->MdlAddress, Piece->MdlAddress, Va + Offset, PieceLength);
+
+        Piece->UserBuffer = (PCHAR) Irp->UserBuffer + Offset;
+        Piece->Flags |= (Irp->Flags & IRP_NOCACHE) |
+            (IrpSp->MajorFunction == IRP_MJ_READ ? IRP_READ_OPERATION : IRP_WRITE_OPERATION);
+
+        //
+        //  The top stack location is our own, and remembers which part of the original
+        //  the piece is for FuseSplitPieceComplete. The one below it is the piece as
+        //  the module sees it
+        //
+
+        IoSetNextIrpStackLocation(Piece);
+
+        PieceSp = IoGetCurrentIrpStackLocation(Piece);
+        PieceSp->MajorFunction = IrpSp->MajorFunction;
+        PieceSp->MinorFunction = IrpSp->MinorFunction;
+        PieceSp->Flags = IrpSp->Flags;
+        PieceSp->DeviceObject = DeviceObject;
+        PieceSp->FileObject = IrpSp->FileObject;
+        PieceSp->Parameters.Read.Length = PieceLength;
+        PieceSp->Parameters.Read.Key = IrpSp->Parameters.Read.Key;
+        PieceSp->Parameters.Read.ByteOffset.QuadPart = Split->ByteOffset + Offset;
+
+        *IoGetNextIrpStackLocation(Piece) = *PieceSp;
+
+        IoSetCompletionRoutine(Piece, FuseSplitPieceComplete, Split, TRUE, TRUE, TRUE);
+
+        InsertTailList(&Pieces, &Piece->Tail.Overlay.ListEntry);
+        Count++;
+    }
+
+    if(Offset < Length) {
+        DbgPrint("Out of memory splitting a request of %d bytes; sending it whole\n", Length);
+
+        while(!IsListEmpty(&Pieces)) {
+            PIRP Piece = CONTAINING_RECORD(RemoveHeadList(&Pieces), IRP, Tail.Overlay.ListEntry);
+
+            IoFreeMdl(Piece->MdlAddress);
+            IoFreeIrp(Piece);
+        }
+
+        ExFreePool(Split);
+
+        return FALSE;
+    }
+
+    Split->Pieces = Count;
+    Irp->AssociatedIrp.IrpCount = Count;
+
+    IoMarkIrpPending(Irp);
+
+    //
+    //  The original may be completed, and gone, as soon as the last piece is on its way
+    //
+
+    while(!IsListEmpty(&Pieces)) {
+        PIRP Piece = CONTAINING_RECORD(RemoveHeadList(&Pieces), IRP, Tail.Overlay.ListEntry);
+
+        IoSetNextIrpStackLocation(Piece);
+
+        FuseAddUserspaceIrp(Piece, IoGetCurrentIrpStackLocation(Piece));
+    }
+
+    return TRUE;
+}
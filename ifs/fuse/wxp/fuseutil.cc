@@ -88,6 +88,132 @@ FuseMapUserBuffer (
     }
 }
 
+PVOID
+FuseMapIntoModule (
+    IN PMODULE_STRUCT ModuleStruct,
+    IN OUT PIRP Irp
+    )
+//
+//  Maps the IRP's locked user buffer into the module's address space, so that
+//  the module can use it where it is instead of having it copied: it reads a
+//  write's data from it, or reads a file into it for a read. The mapping
+//  and the process it is in are kept in the IRP's DriverContext until
+//  FuseUnmapFromModule. Returns the module's address for the buffer, or NULL
+//  if it could not be mapped
+//
+{
+    PEPROCESS Process = ModuleStruct->ModuleProcess;
+    ULONG Priority = NormalPagePriority;
+    BOOLEAN Attached = FALSE;
+    KAPC_STATE ApcState;
+    PVOID Address;
+
+    if(!Irp->MdlAddress || !Process) {
+        return NULL;
+    }
+
+    //
+    //  A module with rings gets its requests packed in the writer's context
+    //
+
+    if(PsGetCurrentProcess() != Process) {
+        KeStackAttachProcess(Process, &ApcState);
+        Attached = TRUE;
+    }
+
+    //
+    //  The module has no business writing to a writer's data
+    //
+
+#ifdef MdlMappingNoWrite
+    if(IoGetCurrentIrpStackLocation(Irp)->MajorFunction == IRP_MJ_WRITE) {
+        Priority |= MdlMappingNoWrite;
+    }
+#endif
+
+    try {
+        Address = MmMapLockedPagesSpecifyCache(Irp->MdlAddress, UserMode, MmCached, NULL, FALSE, Priority);
+    } catch (...) {
+        Address = NULL;
+    }
+
+    if(Attached) {
+        KeUnstackDetachProcess(&ApcState);
+    }
+
+    if(!Address) {
+        return NULL;
+    }
+
+    ObReferenceObject(Process);
+
+    Irp->Tail.Overlay.DriverContext[0] = Address;
+    Irp->Tail.Overlay.DriverContext[1] = Process;
+
+    return Address;
+}
+
+VOID
+FuseUnmapFromModule (
+    IN OUT PIRP Irp
+    )
+//
+//  Undoes FuseMapIntoModule, if it mapped anything. Must be called before the
+//  IRP is completed, since completion unlocks the pages
+//
+{
+    PVOID Address = Irp->Tail.Overlay.DriverContext[0];
+    PEPROCESS Process = (PEPROCESS) Irp->Tail.Overlay.DriverContext[1];
+    BOOLEAN Attached = FALSE;
+    KAPC_STATE ApcState;
+
+    if(!Address) {
+        return;
+    }
+
+    if(PsGetCurrentProcess() != Process) {
+        KeStackAttachProcess(Process, &ApcState);
+        Attached = TRUE;
+    }
+
+    MmUnmapLockedPages(Address, Irp->MdlAddress);
+
+    if(Attached) {
+        KeUnstackDetachProcess(&ApcState);
+    }
+
+    ObDereferenceObject(Process);
+
+    Irp->Tail.Overlay.DriverContext[0] = NULL;
+    Irp->Tail.Overlay.DriverContext[1] = NULL;
+}
+
+VOID
+FuseAdvanceFilePosition (
+    IN PIRP Irp,
+    IN PIO_STACK_LOCATION IrpSp,
+    IN ULONG_PTR Transferred
+    )
+//
+//  Moves the position of a file opened for synchronous I/O past a read or write
+//  that has been done, as the I/O manager expects of a file system: it passes the
+//  position along as the offset of any read or write on the file that doesn't
+//  give one. Paging I/O, I/O at a stand-in offset, and the pieces of a split
+//  request (see FuseSplitIrp) leave it alone
+//
+{
+    PFILE_OBJECT FileObject = IrpSp->FileObject;
+
+    if(!FileObject || !FlagOn(FileObject->Flags, FO_SYNCHRONOUS_IO) ||
+        FlagOn(Irp->Flags, IRP_PAGING_IO | IRP_ASSOCIATED_IRP) ||
+        IrpSp->Parameters.Read.ByteOffset.QuadPart < 0) {
+
+        return;
+    }
+
+    FileObject->CurrentByteOffset.QuadPart = IrpSp->Parameters.Read.ByteOffset.QuadPart + Transferred;
+}
+
 VOID
 FusePrePostIrp (
     IN PIRP Irp
@@ -262,3 +388,21 @@ Return Value:
     }
 }
 
+ULONG
+FuseHashName (
+    IN PCWSTR Name,
+    IN ULONG Length
+    )
+//
+//  Hashes (djb2) the first Length characters of Name
+//
+{
+    ULONG Hash = 5381;
+
+    for(ULONG i = 0; i < Length; i++) {
+        Hash = ((Hash << 5) + Hash) + Name[i];
+    }
+
+    return Hash;
+}
+
@@ -27,6 +27,24 @@ FuseMapUserBuffer (
     IN OUT PIRP Irp
     );
 
+PVOID
+FuseMapIntoModule (
+    IN PMODULE_STRUCT ModuleStruct,
+    IN OUT PIRP Irp
+    );
+
+VOID
+FuseUnmapFromModule (
+    IN OUT PIRP Irp
+    );
+
+VOID
+FuseAdvanceFilePosition (
+    IN PIRP Irp,
+    IN PIO_STACK_LOCATION IrpSp,
+    IN ULONG_PTR Transferred
+    );
+
 VOID
 FusePrePostIrp (
     IN PIRP Irp
@@ -39,6 +57,12 @@ FuseLockUserBuffer (
     IN ULONG BufferLength
     );
 
+ULONG
+FuseHashName (
+    IN PCWSTR Name,
+    IN ULONG Length
+    );
+
 /*
  * Simple wrapper for Ex*FastMutex since GCC doesn't support SEH __finally
  * extensions.
@@ -54,4 +78,108 @@ public:
 	}
 };
 
+/*
+ * Allocators for RequestTable and PairingQueue (see reqtable.h,
+ * pairqueue.h). The queue's shards hold FAST_MUTEXes, so they have to
+ * come from nonpaged pool.
+ */
+struct FusePoolAllocator {
+	static PVOID Allocate(size_t n) {
+		return ExAllocatePoolWithTag(PagedPool, n, M_FUSE);
+	}
+	static VOID Free(PVOID p) {
+		ExFreePool(p);
+	}
+};
+
+struct FuseNonPagedPoolAllocator {
+	static PVOID Allocate(size_t n) {
+		return ExAllocatePoolWithTag(NonPagedPool, n, M_FUSE);
+	}
+	static VOID Free(PVOID p) {
+		ExFreePool(p);
+	}
+};
+
+/*
+ * Lock policy for PairingQueue and HashTable (see pairqueue.h, hashtable.h).
+ * Holding an ERESOURCE requires normal kernel APCs to be disabled.
+ */
+struct FuseSync {
+	typedef FAST_MUTEX Lock;
+	static VOID InitLock(PFAST_MUTEX m) {
+		ExInitializeFastMutex(m);
+	}
+	static VOID Acquire(PFAST_MUTEX m) {
+		ExAcquireFastMutex(m);
+	}
+	static VOID Release(PFAST_MUTEX m) {
+		ExReleaseFastMutex(m);
+	}
+	static LONG Add(volatile LONG *v, LONG d) {
+		return InterlockedExchangeAdd(v, d) + d;
+	}
+	static LONG CompareExchange(volatile LONG *v, LONG x, LONG c) {
+		return InterlockedCompareExchange(v, x, c);
+	}
+	static VOID Yield() {
+		YieldProcessor();
+	}
+
+	typedef ERESOURCE RwLock;
+	static VOID InitRwLock(PERESOURCE r) {
+		ExInitializeResourceLite(r);
+	}
+	static VOID DeleteRwLock(PERESOURCE r) {
+		ExDeleteResourceLite(r);
+	}
+	static VOID AcquireShared(PERESOURCE r) {
+		KeEnterCriticalRegion();
+		ExAcquireResourceSharedLite(r, TRUE);
+	}
+	static VOID ReleaseShared(PERESOURCE r) {
+		ExReleaseResourceLite(r);
+		KeLeaveCriticalRegion();
+	}
+	static VOID AcquireExclusive(PERESOURCE r) {
+		KeEnterCriticalRegion();
+		ExAcquireResourceExclusiveLite(r, TRUE);
+	}
+	static VOID ReleaseExclusive(PERESOURCE r) {
+		ExReleaseResourceLite(r);
+		KeLeaveCriticalRegion();
+	}
+};
+
+/*
+ * Key traits for the module map: nul-terminated module names.
+ */
+struct FuseModuleNameTraits {
+	static uint32_t Hash(WCHAR *k) {
+		return FuseHashName(k, (ULONG) wcslen(k));
+	}
+	static bool Equal(WCHAR *a, WCHAR *b) {
+		return wcscmp(a, b) == 0;
+	}
+};
+
+/*
+ * Key traits for the file context map: file object pointers. The table
+ * indexes on the low bits of the hash, which for pool addresses are nearly
+ * all the same, so mix the high ones down.
+ */
+struct FuseFileObjectTraits {
+	static uint32_t Hash(PFILE_OBJECT k) {
+		ULONG_PTR x = (ULONG_PTR) k;
+		uint32_t h = (uint32_t) x ^ (uint32_t) (x >> 16 >> 16);
+		h ^= h >> 16;
+		h *= 0x85EBCA6B;
+		h ^= h >> 13;
+		return h;
+	}
+	static bool Equal(PFILE_OBJECT a, PFILE_OBJECT b) {
+		return a == b;
+	}
+};
+
 #endif
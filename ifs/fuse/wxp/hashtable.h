@@ -0,0 +1,464 @@
+/*++
+
+Copyright (c) 2011 FUSE-NT Authors
+
+Module Name:
+
+    hashtable.h
+
+Abstract:
+
+    This module implements the hash table the driver keeps its mounted
+    modules in (the module map), keyed by module name.
+
+    The table uses open addressing with linear probing over a power-of-two
+    array of slots. Each slot caches its key's hash, so a probe only calls
+    the key comparison on a real candidate, and a removal closes the gap it
+    leaves by shifting the rest of the probe run back (no tombstones).
+
+    Growing does not stop the world: when the table gets three quarters
+    full, a new array twice the size is allocated and the old one is kept
+    alongside it. Every later insert or removal moves a few more entries
+    across, and lookups check both arrays until the old one is empty.
+
+    Lookups take the table's lock shared, inserts and removals take it
+    exclusive. Nothing in here depends on the kernel. The includer supplies
+    uint32_t, an Allocator (see nodecache.h), key Traits:
+
+        static uint32_t Hash(K Key);
+        static bool Equal(K A, K B);
+
+    and a Sync policy:
+
+        typedef ... RwLock;
+        static void InitRwLock(RwLock*);
+        static void DeleteRwLock(RwLock*);
+        static void AcquireShared(RwLock*);
+        static void ReleaseShared(RwLock*);
+        static void AcquireExclusive(RwLock*);
+        static void ReleaseExclusive(RwLock*);
+
+--*/
+
+#ifndef HASHTABLE_H_
+#define HASHTABLE_H_
+
+#include <stddef.h>
+#include <string.h>
+
+//
+//  Number of slots allocated the first time a key is added, and the most
+//  slots a single array will have
+//
+
+#define HASHTABLE_INITIAL_SLOTS 64
+#define HASHTABLE_MAX_SLOTS 0x100000
+
+//
+//  Slots of the old array looked at by each insert or removal while the
+//  table is growing
+//
+
+#define HASHTABLE_MIGRATE_STEP 16
+
+template <typename K, typename V, typename Traits, typename Sync, typename Allocator>
+class HashTable {
+
+    struct Slot {
+        uint32_t Hash;          // Zero when the slot is empty
+        K Key;
+        V Value;
+    };
+
+    struct Array {
+        Slot* Slots;
+        uint32_t Capacity;      // A power of two
+        uint32_t Count;
+    };
+
+    //
+    //  Current is where new keys go. Old is the array being emptied into it
+    //  while the table grows (Old.Slots is NULL otherwise); its slots below
+    //  MigrateIndex have all been moved across
+    //
+
+    Array Current;
+    Array Old;
+    uint32_t MigrateIndex;
+
+    typename Sync::RwLock Lock;
+
+    static uint32_t
+    HashOf (
+        K Key
+        )
+    {
+        uint32_t Hash = Traits::Hash(Key);
+
+        return Hash ? Hash : 1;
+    }
+
+    static Slot*
+    FindIn (
+        Array* A,
+        K Key,
+        uint32_t Hash
+        )
+    {
+        if(!A->Slots) {
+            return NULL;
+        }
+
+        uint32_t Mask = A->Capacity - 1;
+
+        for(uint32_t i = Hash & Mask; ; i = (i + 1) & Mask) {
+            Slot* S = &A->Slots[i];
+
+            if(S->Hash == 0) {
+                return NULL;
+            }
+
+            if(S->Hash == Hash && Traits::Equal(S->Key, Key)) {
+                return S;
+            }
+        }
+    }
+
+    //
+    //  Puts a key known not to be in the array into its first free slot.
+    //  There always is one, since arrays are never let fill up
+    //
+
+    static void
+    PlaceIn (
+        Array* A,
+        K Key,
+        uint32_t Hash,
+        V Value
+        )
+    {
+        uint32_t Mask = A->Capacity - 1;
+        uint32_t i = Hash & Mask;
+
+        while(A->Slots[i].Hash != 0) {
+            i = (i + 1) & Mask;
+        }
+
+        A->Slots[i].Hash = Hash;
+        A->Slots[i].Key = Key;
+        A->Slots[i].Value = Value;
+        A->Count++;
+    }
+
+    //
+    //  Empties slot S, moving later entries of its probe run back into the
+    //  gap so that every entry stays reachable from its home slot
+    //
+
+    static void
+    EraseFrom (
+        Array* A,
+        Slot* S
+        )
+    {
+        uint32_t Mask = A->Capacity - 1;
+        uint32_t Hole = (uint32_t) (S - A->Slots);
+        uint32_t j = Hole;
+
+        for(;;) {
+            j = (j + 1) & Mask;
+
+            Slot* N = &A->Slots[j];
+            if(N->Hash == 0) {
+                break;
+            }
+
+            //
+            //  An entry whose home lies cyclically in (Hole, j] is already
+            //  as close to home as it can get; anything else moves back
+            //
+
+            uint32_t Home = N->Hash & Mask;
+            bool Stays = (Hole <= j) ? (Hole < Home && Home <= j)
+                                     : (Hole < Home || Home <= j);
+
+            if(!Stays) {
+                A->Slots[Hole] = *N;
+                Hole = j;
+            }
+        }
+
+        A->Slots[Hole].Hash = 0;
+        A->Count--;
+    }
+
+    static bool
+    Allocate (
+        Array* A,
+        uint32_t Capacity
+        )
+    {
+        Slot* Slots = (Slot*) Allocator::Allocate(Capacity * sizeof(Slot));
+        if(!Slots) {
+            return false;
+        }
+
+        memset((void*) Slots, 0, Capacity * sizeof(Slot));
+
+        A->Slots = Slots;
+        A->Capacity = Capacity;
+        A->Count = 0;
+
+        return true;
+    }
+
+    //
+    //  Moves up to Budget slots' worth of entries out of the old array,
+    //  freeing it once it is empty
+    //
+
+    void
+    Migrate (
+        uint32_t Budget
+        )
+    {
+        if(!Old.Slots) {
+            return;
+        }
+
+        //
+        //  Taking out the entry at MigrateIndex may shift the next one of its
+        //  run into the same slot, so only move on once the slot is empty.
+        //  Slots below MigrateIndex are empty, so nothing is ever shifted
+        //  back past it
+        //
+
+        while(Budget-- && MigrateIndex < Old.Capacity) {
+            Slot* S = &Old.Slots[MigrateIndex];
+
+            if(S->Hash == 0) {
+                MigrateIndex++;
+            } else {
+                PlaceIn(&Current, S->Key, S->Hash, S->Value);
+                EraseFrom(&Old, S);
+            }
+        }
+
+        if(MigrateIndex == Old.Capacity) {
+            Allocator::Free(Old.Slots);
+
+            Old.Slots = NULL;
+            Old.Capacity = Old.Count = 0;
+        }
+    }
+
+    //
+    //  Makes sure the current array has room for one more entry, starting
+    //  a resize if it is getting full
+    //
+
+    bool
+    Reserve (
+        )
+    {
+        if(!Current.Slots) {
+            return Allocate(&Current, HASHTABLE_INITIAL_SLOTS);
+        }
+
+        if((Current.Count + 1) * 4 <= Current.Capacity * 3) {
+            return true;
+        }
+
+        //
+        //  Only one resize runs at a time. Migrate moves more than enough on
+        //  each write for the last one to be finished by now, but make sure
+        //
+
+        Migrate(~0U);
+
+        if(Current.Capacity * 2 > HASHTABLE_MAX_SLOTS) {
+            return Current.Count + 1 < Current.Capacity;
+        }
+
+        Array New;
+
+        if(!Allocate(&New, Current.Capacity * 2)) {
+            return Current.Count + 1 < Current.Capacity;
+        }
+
+        Old = Current;
+        Current = New;
+        MigrateIndex = 0;
+
+        return true;
+    }
+
+public:
+
+    //
+    //  An all-zero table with its lock set up is a valid empty table; no
+    //  memory is allocated until a key is added
+    //
+
+    void
+    Init (
+        )
+    {
+        Current.Slots = Old.Slots = NULL;
+        Current.Capacity = Current.Count = 0;
+        Old.Capacity = Old.Count = 0;
+        MigrateIndex = 0;
+
+        Sync::InitRwLock(&Lock);
+    }
+
+    //
+    //  Removes every entry, passing each value to Fn (if non-NULL), and
+    //  frees the table. Nobody else may be using it
+    //
+
+    void
+    Destroy (
+        void (*Fn)(V)
+        )
+    {
+        Array* Arrays[2] = { &Current, &Old };
+
+        for(uint32_t a = 0; a < 2; a++) {
+            Array* A = Arrays[a];
+
+            for(uint32_t i = 0; i < A->Capacity; i++) {
+                if(A->Slots[i].Hash != 0 && Fn) {
+                    Fn(A->Slots[i].Value);
+                }
+            }
+
+            if(A->Slots) {
+                Allocator::Free(A->Slots);
+            }
+
+            A->Slots = NULL;
+            A->Capacity = A->Count = 0;
+        }
+
+        Sync::DeleteRwLock(&Lock);
+    }
+
+    uint32_t
+    Size (
+        )
+    {
+        Sync::AcquireShared(&Lock);
+
+        uint32_t Count = Current.Count + Old.Count;
+
+        Sync::ReleaseShared(&Lock);
+
+        return Count;
+    }
+
+    //
+    //  Looks Key up and, if it is found, stores its value in *Value and
+    //  passes it to Fn (if non-NULL) while the table is still locked, so
+    //  that Fn can take a reference before anyone can remove it
+    //
+
+    bool
+    Lookup (
+        K Key,
+        V* Value,
+        void (*Fn)(V)
+        )
+    {
+        uint32_t Hash = HashOf(Key);
+
+        Sync::AcquireShared(&Lock);
+
+        Slot* S = FindIn(&Current, Key, Hash);
+        if(!S) {
+            S = FindIn(&Old, Key, Hash);
+        }
+
+        if(S) {
+            *Value = S->Value;
+
+            if(Fn) {
+                Fn(S->Value);
+            }
+        }
+
+        Sync::ReleaseShared(&Lock);
+
+        return S != NULL;
+    }
+
+    //
+    //  Adds Key. Returns false if Key is already in the table or there was
+    //  no memory to make room for it
+    //
+
+    bool
+    Insert (
+        K Key,
+        V Value
+        )
+    {
+        uint32_t Hash = HashOf(Key);
+        bool Inserted = false;
+
+        Sync::AcquireExclusive(&Lock);
+
+        Migrate(HASHTABLE_MIGRATE_STEP);
+
+        if(!FindIn(&Current, Key, Hash) && !FindIn(&Old, Key, Hash) && Reserve()) {
+            PlaceIn(&Current, Key, Hash, Value);
+            Inserted = true;
+        }
+
+        Sync::ReleaseExclusive(&Lock);
+
+        return Inserted;
+    }
+
+    //
+    //  Removes Key, storing its value in *Value if Value is non-NULL.
+    //  Returns false if Key is not in the table
+    //
+
+    bool
+    Remove (
+        K Key,
+        V* Value
+        )
+    {
+        uint32_t Hash = HashOf(Key);
+        bool Removed = false;
+
+        Sync::AcquireExclusive(&Lock);
+
+        Migrate(HASHTABLE_MIGRATE_STEP);
+
+        Array* A = &Current;
+        Slot* S = FindIn(A, Key, Hash);
+
+        if(!S) {
+            A = &Old;
+            S = FindIn(A, Key, Hash);
+        }
+
+        if(S) {
+            if(Value) {
+                *Value = S->Value;
+            }
+
+            EraseFrom(A, S);
+            Removed = true;
+        }
+
+        Sync::ReleaseExclusive(&Lock);
+
+        return Removed;
+    }
+};
+
+#endif // HASHTABLE_H_
@@ -0,0 +1,475 @@
+/*++
+
+Copyright (c) 2011 FUSE-NT Authors
+
+Module Name:
+
+    negcache.h
+
+Abstract:
+
+    This module implements the negative name cache: names on a module that
+    the module has said don't exist, so that opening one of them again can
+    be failed in the driver rather than going all the way to the module and
+    back. Explorer and shell extensions probe for desktop.ini, Thumbs.db,
+    autorun.inf and the like in every directory they look at, and nearly
+    all of those probes miss.
+
+    Names are paths on the module (less the module name), matched exactly
+    as they were opened, or ignoring case if the module looks names up that
+    way (see IgnoreCase), in which case they are kept folded and every name
+    passed in is folded before it is hashed. Each is cached for as long as
+    the module said it may be (its negative timeout), and under its parent
+    directory's current generation. Creating or renaming something into a
+    directory bumps the directory's generation, which leaves every name
+    cached under it stale at once. Generations are kept in a fixed array
+    indexed by a hash of the directory, so directories that collide only go
+    stale more often than they need to.
+
+    An open racing with a create in the same directory may hear back from
+    the module after the create is done, with an answer from before it. So
+    the caller takes a ticket (the directory's generation) before it asks
+    the module, and a name is only cached if the ticket is still current.
+
+    At most NEGCACHE_MAX_ENTRIES names are kept, chained in a fixed array of
+    hash buckets; the least recently used is evicted to make room. The cache
+    takes its own lock, and keeps everything but a pointer in a table that
+    Init allocates, so it can be declared before the Sync policy is
+    defined. Nothing in here depends on the kernel. The includer
+    supplies uint32_t, uint64_t, int32_t, an Allocator (see nodecache.h),
+    a Sync policy:
+
+        typedef ... Lock;
+        static void InitLock(Lock*);
+        static void Acquire(Lock*);
+        static void Release(Lock*);
+
+    and the character type of names, whose path separator is '\\'. Times are
+    in whatever units the caller likes, as long as it sticks to them.
+
+--*/
+
+#ifndef NEGCACHE_H_
+#define NEGCACHE_H_
+
+#include <stddef.h>
+#include <string.h>
+
+//
+//  Most names a cache holds, its number of hash buckets and of directory
+//  generations (both powers of two), and the longest name it will cache,
+//  in characters
+//
+
+#define NEGCACHE_MAX_ENTRIES 512
+#define NEGCACHE_BUCKETS 256
+#define NEGCACHE_DIR_SLOTS 256
+#define NEGCACHE_MAX_NAME 260
+
+template <typename Char, typename Sync, typename Allocator>
+class NegativeNameCache {
+
+    struct Entry {
+        Entry* HashNext;
+        Entry* LruPrev;
+        Entry* LruNext;
+        uint64_t Expires;
+        uint32_t Hash;
+        uint32_t DirSlot;
+        uint32_t Generation;    // Of the parent directory when cached
+        int32_t Status;         // What the module answered
+        uint32_t Length;        // In characters
+        Char Name[1];
+    };
+
+    struct Table {
+        typename Sync::Lock Lock;
+
+        Entry* Buckets[NEGCACHE_BUCKETS];
+        uint32_t Generations[NEGCACHE_DIR_SLOTS];
+
+        //
+        //  LRU list sentinel; Lru.LruNext is the most recently used name
+        //
+
+        Entry Lru;
+        uint32_t Count;
+
+        //
+        //  Folds a character for IgnoreCase, or NULL to match exactly
+        //
+
+        Char (*Fold)(Char);
+
+        uint64_t Hits;
+        uint64_t Misses;
+    };
+
+    Table* T;
+
+    Char
+    FoldOf (
+        Char C
+        )
+    {
+        return T->Fold ? T->Fold(C) : C;
+    }
+
+    uint32_t
+    HashOf (
+        const Char* Name,
+        uint32_t Length
+        )
+    {
+        uint32_t Hash = 2166136261u;
+
+        for(uint32_t i = 0; i < Length; i++) {
+            Hash = (Hash ^ (uint32_t) FoldOf(Name[i])) * 16777619u;
+        }
+
+        return Hash;
+    }
+
+    bool
+    SameName (
+        const Char* Folded,
+        const Char* Name,
+        uint32_t Length
+        )
+    {
+        for(uint32_t i = 0; i < Length; i++) {
+            if(Folded[i] != FoldOf(Name[i])) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    //
+    //  Returns the generation slot of the directory a name is in
+    //
+
+    uint32_t
+    DirSlotOf (
+        const Char* Name,
+        uint32_t Length
+        )
+    {
+        uint32_t DirLength = Length;
+
+        while(DirLength > 0 && Name[DirLength - 1] != (Char) '\\') {
+            DirLength--;
+        }
+
+        //
+        //  Leave off the separator itself
+        //
+
+        if(DirLength > 0) {
+            DirLength--;
+        }
+
+        return HashOf(Name, DirLength) & (NEGCACHE_DIR_SLOTS - 1);
+    }
+
+    //
+    //  Returns the link pointing at the entry for the given name, or at the
+    //  NULL ending its chain if it isn't cached
+    //
+
+    Entry**
+    Find (
+        const Char* Name,
+        uint32_t Length,
+        uint32_t Hash
+        )
+    {
+        Entry** Link = &T->Buckets[Hash & (NEGCACHE_BUCKETS - 1)];
+
+        while(*Link) {
+            Entry* E = *Link;
+
+            if(E->Hash == Hash && E->Length == Length && SameName(E->Name, Name, Length)) {
+                break;
+            }
+
+            Link = &E->HashNext;
+        }
+
+        return Link;
+    }
+
+    void
+    Drop (
+        Entry** Link
+        )
+    {
+        Entry* E = *Link;
+
+        *Link = E->HashNext;
+        E->LruPrev->LruNext = E->LruNext;
+        E->LruNext->LruPrev = E->LruPrev;
+        T->Count--;
+
+        Allocator::Free(E);
+    }
+
+    void
+    DropOldest (
+        )
+    {
+        Entry* Oldest = T->Lru.LruPrev;
+
+        Drop(Find(Oldest->Name, Oldest->Length, Oldest->Hash));
+    }
+
+public:
+
+    //
+    //  Sets up an empty cache. Returns false if out of memory, in which case
+    //  the cache must not be used, though Destroy is harmless
+    //
+
+    bool
+    Init (
+        )
+    {
+        T = (Table*) Allocator::Allocate(sizeof(Table));
+        if(!T) {
+            return false;
+        }
+
+        memset((void*) T, 0, sizeof(Table));
+
+        Sync::InitLock(&T->Lock);
+        T->Lru.LruPrev = T->Lru.LruNext = &T->Lru;
+
+        return true;
+    }
+
+    //
+    //  Matches names ignoring case from now on, folding each character with
+    //  Fold. Must be called before the cache is first used
+    //
+
+    void
+    IgnoreCase (
+        Char (*Fold)(Char)
+        )
+    {
+        T->Fold = Fold;
+    }
+
+    //
+    //  Frees every cached name and the table. Nobody else may be using the
+    //  cache
+    //
+
+    void
+    Destroy (
+        )
+    {
+        if(!T) {
+            return;
+        }
+
+        while(T->Count) {
+            DropOldest();
+        }
+
+        Allocator::Free(T);
+        T = NULL;
+    }
+
+    //
+    //  Looks up a name as of time Now. If the name is cached as missing, sets
+    //  *Status to what the module answered and returns true
+    //
+
+    bool
+    Lookup (
+        const Char* Name,
+        uint32_t Length,
+        uint64_t Now,
+        int32_t* Status
+        )
+    {
+        uint32_t Hash = HashOf(Name, Length);
+        bool Found = false;
+
+        Sync::Acquire(&T->Lock);
+
+        Entry** Link = Find(Name, Length, Hash);
+        Entry* E = *Link;
+
+        if(E && (E->Generation != T->Generations[E->DirSlot] || Now >= E->Expires)) {
+            Drop(Link);
+            E = NULL;
+        }
+
+        if(E) {
+
+            //
+            //  Move it to the front of the LRU list
+            //
+
+            E->LruPrev->LruNext = E->LruNext;
+            E->LruNext->LruPrev = E->LruPrev;
+            E->LruNext = T->Lru.LruNext;
+            E->LruPrev = &T->Lru;
+            T->Lru.LruNext->LruPrev = E;
+            T->Lru.LruNext = E;
+
+            *Status = E->Status;
+            Found = true;
+            T->Hits++;
+        } else {
+            T->Misses++;
+        }
+
+        Sync::Release(&T->Lock);
+
+        return Found;
+    }
+
+    //
+    //  Returns the ticket to pass to Insert for a name about to be looked up
+    //  by the module
+    //
+
+    uint32_t
+    Ticket (
+        const Char* Name,
+        uint32_t Length
+        )
+    {
+        uint32_t Slot = DirSlotOf(Name, Length);
+        uint32_t Generation;
+
+        Sync::Acquire(&T->Lock);
+        Generation = T->Generations[Slot];
+        Sync::Release(&T->Lock);
+
+        return Generation;
+    }
+
+    //
+    //  Caches a name the module said is missing, with the status it answered,
+    //  until Now + Timeout. Nothing is cached if the timeout is zero, if the
+    //  name is too long, if its directory has changed since Ticket was taken,
+    //  or if there is no memory for it
+    //
+
+    void
+    Insert (
+        const Char* Name,
+        uint32_t Length,
+        int32_t Status,
+        uint64_t Now,
+        uint64_t Timeout,
+        uint32_t Ticket
+        )
+    {
+        uint32_t Hash = HashOf(Name, Length);
+        uint32_t Slot = DirSlotOf(Name, Length);
+
+        if(!Timeout || Length > NEGCACHE_MAX_NAME) {
+            return;
+        }
+
+        Entry* E = (Entry*) Allocator::Allocate(offsetof(Entry, Name) + Length * sizeof(Char));
+        if(!E) {
+            return;
+        }
+
+        E->Expires = Now + Timeout;
+        E->Hash = Hash;
+        E->DirSlot = Slot;
+        E->Generation = Ticket;
+        E->Status = Status;
+        E->Length = Length;
+
+        for(uint32_t i = 0; i < Length; i++) {
+            E->Name[i] = FoldOf(Name[i]);
+        }
+
+        Sync::Acquire(&T->Lock);
+
+        if(Ticket != T->Generations[Slot]) {
+            Sync::Release(&T->Lock);
+            Allocator::Free(E);
+
+            return;
+        }
+
+        Entry** Link = Find(Name, Length, Hash);
+        if(*Link) {
+            Drop(Link);
+        }
+
+        while(T->Count >= NEGCACHE_MAX_ENTRIES) {
+            DropOldest();
+        }
+
+        E->HashNext = T->Buckets[Hash & (NEGCACHE_BUCKETS - 1)];
+        T->Buckets[Hash & (NEGCACHE_BUCKETS - 1)] = E;
+
+        E->LruNext = T->Lru.LruNext;
+        E->LruPrev = &T->Lru;
+        T->Lru.LruNext->LruPrev = E;
+        T->Lru.LruNext = E;
+        T->Count++;
+
+        Sync::Release(&T->Lock);
+    }
+
+    //
+    //  Forgets every name in the directory the given name is in, which
+    //  something has just been created in (or renamed into)
+    //
+
+    void
+    InvalidateParent (
+        const Char* Name,
+        uint32_t Length
+        )
+    {
+        uint32_t Slot = DirSlotOf(Name, Length);
+
+        Sync::Acquire(&T->Lock);
+        T->Generations[Slot]++;
+        Sync::Release(&T->Lock);
+    }
+
+    //
+    //  Forgets every name
+    //
+
+    void
+    InvalidateAll (
+        )
+    {
+        Sync::Acquire(&T->Lock);
+
+        for(uint32_t i = 0; i < NEGCACHE_DIR_SLOTS; i++) {
+            T->Generations[i]++;
+        }
+
+        Sync::Release(&T->Lock);
+    }
+
+    void
+    Stats (
+        uint64_t* HitCount,
+        uint64_t* MissCount
+        )
+    {
+        Sync::Acquire(&T->Lock);
+        *HitCount = T->Hits;
+        *MissCount = T->Misses;
+        Sync::Release(&T->Lock);
+    }
+};
+
+#endif // NEGCACHE_H_
@@ -0,0 +1,136 @@
+/*++
+
+Copyright (c) 2011 FUSE-NT Authors
+
+Module Name:
+
+    nodecache.h
+
+Abstract:
+
+    This module implements a cache of fixed-size queue nodes (the entries of
+    the driver's IRP queue; see pairqueue.h). Nodes freed back to the cache
+    are kept on a free list and handed out again, so queueing and dequeueing
+    IRPs only goes to the pool allocator while the cache is warming up or
+    when more IRPs are queued at once than it keeps around.
+
+    Like reqtable.h, nothing in here depends on the kernel: the includer
+    supplies uint32_t and uint64_t, a Node type with a Next pointer, and an
+    Allocator with static Allocate(size_t) and Free(void*) members. The cache
+    does no locking of its own; each queue shard only touches its cache
+    under the shard lock it already holds to manipulate its lists.
+
+--*/
+
+#ifndef NODECACHE_H_
+#define NODECACHE_H_
+
+#include <stddef.h>
+
+//
+//  Most nodes a cache will hold on to; anything freed past this goes
+//  back to the allocator
+//
+
+#define NODECACHE_MAX_DEPTH 256
+
+template <typename Node, typename Allocator>
+class NodeCache {
+
+    Node* FreeList;
+    uint32_t Depth;
+
+    //
+    //  Allocations satisfied from the free list, and ones that had to go
+    //  to the allocator
+    //
+
+    uint64_t Hits;
+    uint64_t Misses;
+
+public:
+
+    //
+    //  An all-zero cache is a valid empty cache, so one embedded in a
+    //  structure from RtlZeroMemory'd pool is ready to use
+    //
+
+    NodeCache() : FreeList(NULL), Depth(0), Hits(0), Misses(0) {}
+
+    //
+    //  Returns a node, or NULL if the cache is empty and the allocator
+    //  failed. The node's contents are undefined
+    //
+
+    Node*
+    Allocate (
+        )
+    {
+        Node* N = FreeList;
+
+        if(N) {
+            FreeList = N->Next;
+            Depth--;
+            Hits++;
+
+            return N;
+        }
+
+        Misses++;
+
+        return (Node*) Allocator::Allocate(sizeof(Node));
+    }
+
+    //
+    //  Returns a node to the cache
+    //
+
+    void
+    Free (
+        Node* N
+        )
+    {
+        if(Depth >= NODECACHE_MAX_DEPTH) {
+            Allocator::Free(N);
+            return;
+        }
+
+        N->Next = FreeList;
+        FreeList = N;
+        Depth++;
+    }
+
+    //
+    //  Frees every cached node
+    //
+
+    void
+    Drain (
+        )
+    {
+        while(FreeList) {
+            Node* Next = FreeList->Next;
+
+            Allocator::Free(FreeList);
+            FreeList = Next;
+        }
+
+        Depth = 0;
+    }
+
+    uint64_t
+    HitCount (
+        ) const
+    {
+        return Hits;
+    }
+
+    uint64_t
+    MissCount (
+        ) const
+    {
+        return Misses;
+    }
+};
+
+#endif // NODECACHE_H_
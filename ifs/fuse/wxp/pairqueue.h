@@ -0,0 +1,427 @@
+/*++
+
+Copyright (c) 2011 FUSE-NT Authors
+
+Module Name:
+
+    pairqueue.h
+
+Abstract:
+
+    This module implements the queue that pairs userspace requests ("work")
+    with module IRPs waiting for something to do ("workers").
+
+    The queue is split into shards, normally one per processor, each with its
+    own lock and its own FIFO of each kind. Callers add to the shard for the
+    processor they are running on, so submitters and pollers on different
+    processors don't contend.
+
+    Whether an arrival can be paired up is decided without looking at the
+    shards at all: Balance counts work added minus workers added. An item
+    is queued *before* Balance is updated, and the arrival whose update
+    shows there is a counterpart waiting (work taking Balance to <= 0, a
+    worker taking it to >= 0) has claimed exactly one pair. It then takes
+    one item of each kind, from its own shard if it can and stealing from
+    the others if not. Every claim is backed by items that are already
+    queued, so TakePair always finds them, and no item can be left waiting
+    while a counterpart sits in another shard.
+
+    Nothing in here depends on the kernel. The includer supplies uint32_t,
+    uint64_t, an Allocator (see nodecache.h), and a Sync policy:
+
+        typedef ... Lock;
+        static void InitLock(Lock*);
+        static void Acquire(Lock*);
+        static void Release(Lock*);
+        static long Add(volatile long* Value, long Delta);  // returns new value
+        static long CompareExchange(volatile long* Value, long Exchange,
+                                    long Comparand);        // returns old value
+        static void Yield();
+
+--*/
+
+#ifndef PAIRQUEUE_H_
+#define PAIRQUEUE_H_
+
+#include <stddef.h>
+#include <string.h>
+
+#include "nodecache.h"
+
+//
+//  The two kinds of item the queue pairs up
+//
+
+#define PAIRQUEUE_WORK 0
+#define PAIRQUEUE_WORKER 1
+
+#define PAIRQUEUE_MAX_SHARDS 64
+
+template <typename T, typename Sync, typename Allocator>
+class PairingQueue {
+
+    struct Entry {
+        T Value;
+        Entry* Next;
+    };
+
+    struct Shard {
+        typename Sync::Lock Lock;
+        Entry* Head[2];
+        Entry* Tail[2];
+        NodeCache<Entry, Allocator> Cache;
+    };
+
+    Shard* Shards;
+    uint32_t ShardCount;
+    volatile long Balance;
+
+    //
+    //  Pops the oldest item of the given kind from shard S, if any
+    //
+
+    bool
+    PopFrom (
+        Shard* S,
+        uint32_t Kind,
+        T* Value
+        )
+    {
+        bool Found = false;
+
+        Sync::Acquire(&S->Lock);
+
+        Entry* E = S->Head[Kind];
+        if(E) {
+            S->Head[Kind] = E->Next;
+
+            if(!S->Head[Kind]) {
+                S->Tail[Kind] = NULL;
+            }
+
+            *Value = E->Value;
+            S->Cache.Free(E);
+            Found = true;
+        }
+
+        Sync::Release(&S->Lock);
+
+        return Found;
+    }
+
+    //
+    //  Pops the oldest item of the given kind from shard S that Match accepts,
+    //  if any
+    //
+
+    bool
+    PopMatchingFrom (
+        Shard* S,
+        uint32_t Kind,
+        bool (*Match)(T, void*),
+        void* Context,
+        T* Value
+        )
+    {
+        bool Found = false;
+        Entry* Prev = NULL;
+
+        Sync::Acquire(&S->Lock);
+
+        for(Entry* E = S->Head[Kind]; E; Prev = E, E = E->Next) {
+            if(!Match(E->Value, Context)) {
+                continue;
+            }
+
+            if(Prev) {
+                Prev->Next = E->Next;
+            } else {
+                S->Head[Kind] = E->Next;
+            }
+
+            if(S->Tail[Kind] == E) {
+                S->Tail[Kind] = Prev;
+            }
+
+            *Value = E->Value;
+            S->Cache.Free(E);
+            Found = true;
+            break;
+        }
+
+        Sync::Release(&S->Lock);
+
+        return Found;
+    }
+
+    //
+    //  Pops an item of the given kind, starting at the home shard and then
+    //  stealing from the others. Only called on behalf of a claim, so an
+    //  item is there to be found; if other claimants beat us to the ones we
+    //  looked at, go around again
+    //
+
+    T
+    Pop (
+        uint32_t Kind,
+        uint32_t Home
+        )
+    {
+        T Value;
+
+        for(;;) {
+            for(uint32_t i = 0; i < ShardCount; i++) {
+                if(PopFrom(&Shards[(Home + i) % ShardCount], Kind, &Value)) {
+                    return Value;
+                }
+            }
+
+            Sync::Yield();
+        }
+    }
+
+public:
+
+    //
+    //  An all-zero queue has no shards; Init must be called before use
+    //
+
+    PairingQueue() : Shards(NULL), ShardCount(0), Balance(0) {}
+
+    bool
+    Init (
+        uint32_t Count
+        )
+    {
+        if(Count == 0) {
+            Count = 1;
+        } else if(Count > PAIRQUEUE_MAX_SHARDS) {
+            Count = PAIRQUEUE_MAX_SHARDS;
+        }
+
+        Shards = (Shard*) Allocator::Allocate(Count * sizeof(Shard));
+        if(!Shards) {
+            return false;
+        }
+
+        //
+        //  Empty lists and an all-zero NodeCache are both valid, so zeroing
+        //  leaves only the locks to set up
+        //
+
+        memset((void*) Shards, 0, Count * sizeof(Shard));
+
+        for(uint32_t i = 0; i < Count; i++) {
+            Sync::InitLock(&Shards[i].Lock);
+        }
+
+        ShardCount = Count;
+        Balance = 0;
+
+        return true;
+    }
+
+    //
+    //  Removes every queued item, passing each to Fn, and frees the shards.
+    //  Nobody else may be using the queue
+    //
+
+    void
+    Destroy (
+        void (*Fn)(T)
+        )
+    {
+        for(uint32_t i = 0; i < ShardCount; i++) {
+            for(uint32_t Kind = PAIRQUEUE_WORK; Kind <= PAIRQUEUE_WORKER; Kind++) {
+                Entry* E = Shards[i].Head[Kind];
+
+                while(E) {
+                    Entry* Next = E->Next;
+
+                    Fn(E->Value);
+                    Allocator::Free(E);
+                    E = Next;
+                }
+            }
+
+            Shards[i].Cache.Drain();
+        }
+
+        if(Shards) {
+            Allocator::Free(Shards);
+        }
+
+        Shards = NULL;
+        ShardCount = 0;
+    }
+
+    //
+    //  Queues an item on the shard picked by Hint (e.g. the current processor
+    //  number). On return *Matched says whether this arrival claimed a pair,
+    //  in which case the caller must call TakePair exactly once. Returns false
+    //  (and queues nothing) if no entry could be allocated
+    //
+
+    bool
+    Add (
+        uint32_t Kind,
+        T Value,
+        uint32_t Hint,
+        bool* Matched
+        )
+    {
+        Shard* S = &Shards[Hint % ShardCount];
+
+        Sync::Acquire(&S->Lock);
+
+        Entry* E = S->Cache.Allocate();
+        if(!E) {
+            Sync::Release(&S->Lock);
+
+            return false;
+        }
+
+        E->Value = Value;
+        E->Next = NULL;
+
+        if(S->Tail[Kind]) {
+            S->Tail[Kind]->Next = E;
+        } else {
+            S->Head[Kind] = E;
+        }
+
+        S->Tail[Kind] = E;
+
+        Sync::Release(&S->Lock);
+
+        if(Kind == PAIRQUEUE_WORK) {
+            *Matched = Sync::Add(&Balance, 1) <= 0;
+        } else {
+            *Matched = Sync::Add(&Balance, -1) >= 0;
+        }
+
+        return true;
+    }
+
+    //
+    //  Takes the pair claimed by an Add that reported a match
+    //
+
+    void
+    TakePair (
+        uint32_t Hint,
+        T* Work,
+        T* Worker
+        )
+    {
+        uint32_t Home = Hint % ShardCount;
+
+        *Work = Pop(PAIRQUEUE_WORK, Home);
+        *Worker = Pop(PAIRQUEUE_WORKER, Home);
+    }
+
+    //
+    //  Takes an item of the given kind that no arrival has claimed, if there
+    //  is one, without a counterpart. This is for a caller that already holds
+    //  a counterpart with room for more than one item of this kind (e.g. a
+    //  worker that takes work in batches). Claiming the item works just like
+    //  an arrival of the other kind that pairs up, so the claim is backed by
+    //  a queued item and Pop finds it
+    //
+
+    bool
+    TakeUnclaimed (
+        uint32_t Kind,
+        uint32_t Hint,
+        T* Value
+        )
+    {
+        long Delta = (Kind == PAIRQUEUE_WORK) ? 1 : -1;
+        long Old;
+
+        do {
+            Old = Balance;
+
+            if(Old * Delta <= 0) {
+                return false;
+            }
+        } while(Sync::CompareExchange(&Balance, Old - Delta, Old) != Old);
+
+        *Value = Pop(Kind, Hint % ShardCount);
+
+        return true;
+    }
+
+    //
+    //  Like TakeUnclaimed, but only takes an item that Match accepts (e.g.
+    //  one queued by a particular thread). Match is called with a shard
+    //  locked. If there is no such item, the claim taken while looking is
+    //  given back, which counts as an arrival of the given kind: *Matched
+    //  then says, as for Add, whether the caller must call TakePair
+    //
+
+    bool
+    TakeUnclaimedMatching (
+        uint32_t Kind,
+        uint32_t Hint,
+        bool (*Match)(T, void*),
+        void* Context,
+        T* Value,
+        bool* Matched
+        )
+    {
+        long Delta = (Kind == PAIRQUEUE_WORK) ? 1 : -1;
+        uint32_t Home = Hint % ShardCount;
+        long Old;
+
+        *Matched = false;
+
+        do {
+            Old = Balance;
+
+            if(Old * Delta <= 0) {
+                return false;
+            }
+        } while(Sync::CompareExchange(&Balance, Old - Delta, Old) != Old);
+
+        //
+        //  The claim is backed by some queued item of this kind, so taking
+        //  any one of them keeps the count right
+        //
+
+        for(uint32_t i = 0; i < ShardCount; i++) {
+            if(PopMatchingFrom(&Shards[(Home + i) % ShardCount], Kind, Match, Context, Value)) {
+                return true;
+            }
+        }
+
+        if(Kind == PAIRQUEUE_WORK) {
+            *Matched = Sync::Add(&Balance, 1) <= 0;
+        } else {
+            *Matched = Sync::Add(&Balance, -1) >= 0;
+        }
+
+        return false;
+    }
+
+    //
+    //  Entry cache hits and misses summed over all shards. Unlocked, so
+    //  only exact when nobody else is using the queue
+    //
+
+    void
+    CacheStats (
+        uint64_t* Hits,
+        uint64_t* Misses
+        )
+    {
+        *Hits = *Misses = 0;
+
+        for(uint32_t i = 0; i < ShardCount; i++) {
+            *Hits += Shards[i].Cache.HitCount();
+            *Misses += Shards[i].Cache.MissCount();
+        }
+    }
+};
+
+#endif // PAIRQUEUE_H_
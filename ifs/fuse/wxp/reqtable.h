@@ -0,0 +1,244 @@
+/*++
+
+Copyright (c) 2011 FUSE-NT Authors
+
+Module Name:
+
+    reqtable.h
+
+Abstract:
+
+    This module implements the table of outstanding requests: userspace IRPs
+    that have been handed to a module and are waiting for its response.
+
+    Each outstanding request gets a slot in a growable array and is named by
+    a request ID that encodes the slot index and the slot's generation. The
+    module echoes the ID back in its FUSENT_RESP, so finding (and validating)
+    the IRP a response belongs to is a single array access no matter how many
+    requests are in flight. Freed slots bump their generation, so a stale or
+    forged ID never matches a slot that has since been reused.
+
+    Nothing in here depends on the kernel: the includer supplies uint32_t and
+    uint64_t, and an Allocator with static Allocate(size_t) and Free(void*)
+    members, so the table can be built and exercised as ordinary C++. It does
+    no locking of its own; callers serialize access (the driver holds the
+    module's ModuleLock).
+
+--*/
+
+#ifndef REQTABLE_H_
+#define REQTABLE_H_
+
+#include <stddef.h>
+
+//
+//  Number of slots allocated the first time a request is added, and the
+//  most the table will ever grow to
+//
+
+#define REQTABLE_INITIAL_SLOTS 64
+#define REQTABLE_MAX_SLOTS 0x100000
+
+template <typename T, typename Allocator>
+class RequestTable {
+
+    struct Slot {
+        uint32_t Generation;
+        uint32_t NextFree;      // Free list link; only meaningful while !InUse
+        bool InUse;
+        T Value;
+    };
+
+    Slot* Slots;
+    uint32_t Capacity;
+    uint32_t Count;
+    uint32_t FreeHead;          // == Capacity when no slot is free
+
+    //
+    //  Request IDs are (Generation << 32) | (Index + 1), which keeps zero
+    //  free to mean "no request"
+    //
+
+    static uint64_t
+    MakeId (
+        uint32_t Index,
+        uint32_t Generation
+        )
+    {
+        return ((uint64_t) Generation << 32) | (uint64_t) (Index + 1);
+    }
+
+    Slot*
+    FindSlot (
+        uint64_t Id
+        )
+    {
+        uint32_t Index = (uint32_t) Id - 1;
+
+        if((uint32_t) Id == 0 || Index >= Capacity) {
+            return NULL;
+        }
+
+        Slot* S = &Slots[Index];
+        if(!S->InUse || S->Generation != (uint32_t) (Id >> 32)) {
+            return NULL;
+        }
+
+        return S;
+    }
+
+    bool
+    Grow (
+        )
+    {
+        uint32_t NewCapacity = Capacity ? Capacity * 2 : REQTABLE_INITIAL_SLOTS;
+
+        if(NewCapacity > REQTABLE_MAX_SLOTS) {
+            return false;
+        }
+
+        Slot* NewSlots = (Slot*) Allocator::Allocate(NewCapacity * sizeof(Slot));
+        if(!NewSlots) {
+            return false;
+        }
+
+        //
+        //  Existing slots keep their index (IDs already handed out stay
+        //  valid). We only grow when nothing is free, so the new slots
+        //  make up the whole free list
+        //
+
+        for(uint32_t i = 0; i < Capacity; i++) {
+            NewSlots[i] = Slots[i];
+        }
+
+        for(uint32_t i = Capacity; i < NewCapacity; i++) {
+            NewSlots[i].Generation = 0;
+            NewSlots[i].NextFree = i + 1;
+            NewSlots[i].InUse = false;
+        }
+
+        FreeHead = Capacity;
+
+        if(Slots) {
+            Allocator::Free(Slots);
+        }
+
+        Slots = NewSlots;
+        Capacity = NewCapacity;
+
+        return true;
+    }
+
+public:
+
+    //
+    //  An all-zero table is a valid empty table, so one embedded in a
+    //  structure from RtlZeroMemory'd pool is ready to use
+    //
+
+    RequestTable() : Slots(NULL), Capacity(0), Count(0), FreeHead(0) {}
+
+    uint32_t
+    Size (
+        ) const
+    {
+        return Count;
+    }
+
+    //
+    //  Adds a value and returns the ID that names it, or zero if the table
+    //  could not grow to hold it
+    //
+
+    uint64_t
+    Insert (
+        T Value
+        )
+    {
+        if(FreeHead == Capacity && !Grow()) {
+            return 0;
+        }
+
+        uint32_t Index = FreeHead;
+        Slot* S = &Slots[Index];
+
+        FreeHead = S->NextFree;
+        S->InUse = true;
+        S->Value = Value;
+        Count++;
+
+        return MakeId(Index, S->Generation);
+    }
+
+    //
+    //  Returns a pointer to the value named by Id, or NULL if Id does not
+    //  name a live entry
+    //
+
+    T*
+    Lookup (
+        uint64_t Id
+        )
+    {
+        Slot* S = FindSlot(Id);
+
+        return S ? &S->Value : NULL;
+    }
+
+    //
+    //  Removes the entry named by Id, storing its value in *Value if Value is
+    //  non-NULL. Returns false if Id does not name a live entry
+    //
+
+    bool
+    Remove (
+        uint64_t Id,
+        T* Value
+        )
+    {
+        Slot* S = FindSlot(Id);
+
+        if(!S) {
+            return false;
+        }
+
+        if(Value) {
+            *Value = S->Value;
+        }
+
+        S->InUse = false;
+        S->Generation++;
+        S->NextFree = FreeHead;
+        FreeHead = (uint32_t) (S - Slots);
+        Count--;
+
+        return true;
+    }
+
+    //
+    //  Removes every entry, passing each value to Fn, and frees the slots
+    //
+
+    void
+    Drain (
+        void (*Fn)(T)
+        )
+    {
+        for(uint32_t i = 0; i < Capacity; i++) {
+            if(Slots[i].InUse) {
+                Slots[i].InUse = false;
+                Fn(Slots[i].Value);
+            }
+        }
+
+        if(Slots) {
+            Allocator::Free(Slots);
+        }
+
+        Slots = NULL;
+        Capacity = Count = FreeHead = 0;
+    }
+};
+
+#endif // REQTABLE_H_